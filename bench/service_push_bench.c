@@ -0,0 +1,157 @@
+/*
+ * service_push_bench.c
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+
+/* *
+ * service_push_message热路径的多线程伸缩性测试
+ * 每条消息先按handle查服务表得到邮箱，再追加到邮箱的mpsc队列，对比两种读表方式：
+ *   spin  : 与旧实现一样，在全局SPIN_LOCK(S)内读取指针
+ *   epoch : epoch_enter/epoch_leave之间无锁读取
+ * 生产者线程数从1开始倍增，输出每种方式的总吞吐和相对单线程的倍数
+ * 只有线程数不超过cpu核数时倍数才反映多核伸缩性
+ *
+ * 编译(在仓库根目录)：
+ *   cc -O2 -std=gnu99 -D_GNU_SOURCE -Inet/include bench/service_push_bench.c \
+ *      net/src/epoch.c net/src/queue.c net/src/array.c net/src/thread.c \
+ *      -lpthread -o service_push_bench
+ * 运行：
+ *   ./service_push_bench [最大线程数(默认16)] [每线程消息数(默认1000000)]
+ * */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <define.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <queue.h>
+#include <epoch.h>
+
+#define BENCH_SERVICES	64
+
+typedef struct bench_service {
+	int type;
+	mpsc_queue *box;
+} bench_service;
+
+typedef struct bench_pool {
+	bench_service *services[BENCH_SERVICES];
+	spinlock lock;
+} bench_pool;
+
+typedef struct bench_worker {
+	pthread_t tid;
+	int id;
+	int epoch;
+	long count;
+	queue_node *nodes;
+} bench_worker;
+
+static bench_pool g_pool;
+static atomic_t g_start;
+
+static inline double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* 对应service_push_message：查表得到服务，再投递到它的邮箱 */
+static void *bench_producer(void *args) {
+	bench_worker *w = (bench_worker *)args;
+	while(!atomic_get(&g_start)) {
+		;
+	}
+
+	for(long i=0; i<w->count; ++i) {
+		int handle = (int)((i + w->id) & (BENCH_SERVICES - 1));
+		bench_service *s = NULL;
+		if(w->epoch) {
+			epoch_enter();
+			s = ATOM_LOAD_ACQ(&g_pool.services[handle]);
+			mpsc_queue_push(s->box, &w->nodes[i]);
+			epoch_leave();
+		} else {
+			SPIN_LOCK(&g_pool);
+			s = g_pool.services[handle];
+			SPIN_UNLOCK(&g_pool);
+			mpsc_queue_push(s->box, &w->nodes[i]);
+		}
+	}
+
+	return NULL;
+}
+
+/* 取空全部邮箱，返回取出的消息数 */
+static long bench_drain() {
+	long total = 0;
+	for(int i=0; i<BENCH_SERVICES; ++i) {
+		while(TEST_VAILD_PTR(mpsc_queue_try_pop(g_pool.services[i]->box))) {
+			++ total;
+		}
+	}
+
+	return total;
+}
+
+static double bench_run(int threads, long count, int epoch) {
+	bench_worker workers[threads];
+	atomic_set(&g_start, 0);
+	for(int i=0; i<threads; ++i) {
+		workers[i].id = i;
+		workers[i].epoch = epoch;
+		workers[i].count = count;
+		workers[i].nodes = (queue_node *)calloc(count, sizeof(queue_node));
+		CHECK_VAILD_PTR(workers[i].nodes);
+		CHECK(0 == pthread_create(&workers[i].tid, NULL, bench_producer, &workers[i]));
+	}
+
+	double begin = bench_now();
+	atomic_set(&g_start, 1);
+	for(int i=0; i<threads; ++i) {
+		pthread_join(workers[i].tid, NULL);
+	}
+	double cost = bench_now() - begin;
+
+	CHECK(bench_drain() == threads * count);
+	for(int i=0; i<threads; ++i) {
+		FREE(workers[i].nodes);
+	}
+
+	return threads * count / cost;
+}
+
+int main(int argc, char **argv) {
+	int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+	long count = argc > 2 ? atol(argv[2]) : 1000000;
+
+	SPIN_INIT(&g_pool);
+	for(int i=0; i<BENCH_SERVICES; ++i) {
+		MALLOC_DEF(s, bench_service);
+		CHECK_VAILD_PTR(s);
+		s->type = 0;
+		s->box = mpsc_queue_create();
+		CHECK_VAILD_PTR(s->box);
+		g_pool.services[i] = s;
+	}
+
+	printf("%8s %14s %8s %14s %8s\n", "threads", "spin(M/s)", "scale", "epoch(M/s)", "scale");
+	double base[2] = { 0, 0 };
+	for(int threads=1; threads<=max_threads; threads<<=1) {
+		double rate[2];
+		for(int epoch=0; epoch<2; ++epoch) {
+			rate[epoch] = bench_run(threads, count, epoch);
+			if(1 == threads) {
+				base[epoch] = rate[epoch];
+			}
+		}
+		printf("%8d %14.2f %8.2f %14.2f %8.2f\n", threads,
+				rate[0] / 1e6, rate[0] / base[0], rate[1] / 1e6, rate[1] / base[1]);
+	}
+
+	return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * worker_activation_bench.c
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+
+/* *
+ * 大量小servlet激活的线程池吞吐测试
+ * BENCH_SERVLETS个嵌入式task，每个激活BENCH_ACTIVATIONS次，每次做少量计算后重新提交自己，
+ * 与servlet调度结束时仍有消息、由worker直接重新提交的路径一致，对比两种重新提交方式：
+ *   global : threadpool_submit，经过全局bound_block_queue
+ *   steal  : threadpool_try_submit，进入当前worker的本地deque，空闲worker窃取
+ * 线程池每个进程只能初始化一次，每组参数在fork出的子进程中运行
+ *
+ * 编译(在仓库根目录)：
+ *   cc -O2 -std=gnu99 -Inet/include bench/worker_activation_bench.c \
+ *      net/src/thread.c net/src/queue.c net/src/array.c net/src/errcode.c \
+ *      -lpthread -o worker_activation_bench
+ * 运行：
+ *   ./worker_activation_bench [worker数 ...]    默认 4 16 32
+ * */
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <define.h>
+#include <atomic.h>
+#include <errcode.h>
+#include <thread.h>
+
+#define BENCH_SERVLETS		1024
+#define BENCH_ACTIVATIONS	400
+
+typedef struct bench_servlet {
+	threadpool_task task;
+	int left;
+	uint64_t state;
+} bench_servlet;
+
+static bench_servlet g_servlets[BENCH_SERVLETS];
+static atomic_t g_done;
+static bool g_steal;
+
+static inline double bench_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *bench_routine(void *input, int *errcode) {
+	bench_servlet *s = (bench_servlet *)input;
+	/* 模拟一次很短的消息处理 */
+	for(int i=0; i<64; ++i) {
+		s->state = s->state * 6364136223846793005ULL + 1;
+	}
+	*errcode = ERROR_SUCCESS;
+
+	if(-- s->left > 0) {
+		if(!g_steal || !TEST_SUCCESS(threadpool_try_submit(&s->task))) {
+			CHECK_SUCCESS(threadpool_submit(&s->task));
+		}
+	} else {
+		atomic_inc(&g_done);
+	}
+
+	return NULL;
+}
+
+static void bench_run(int workers, bool steal) {
+	threadpool_limit limit;
+	threadpool_limit_init(&limit);
+	threadpool_limit_worker(&limit, workers);
+	threadpool_limit_task(&limit, BENCH_SERVLETS * 4);
+	CHECK_SUCCESS(threadpool_init(&limit));
+
+	g_steal = steal;
+	atomic_set(&g_done, 0);
+	for(int i=0; i<BENCH_SERVLETS; ++i) {
+		g_servlets[i].left = BENCH_ACTIVATIONS;
+		g_servlets[i].state = i;
+		threadpool_task_init(&g_servlets[i].task, bench_routine, &g_servlets[i], NULL);
+	}
+
+	double begin = bench_now();
+	for(int i=0; i<BENCH_SERVLETS; ++i) {
+		CHECK_SUCCESS(threadpool_submit(&g_servlets[i].task));
+	}
+	while(atomic_get(&g_done) < BENCH_SERVLETS) {
+		sched_yield();
+	}
+	double cost = bench_now() - begin;
+
+	threadpool_stat stat;
+	threadpool_get_stat(&stat);
+	printf("%8d %8s %16.2f %12llu %12llu\n", workers, steal ? "steal" : "global",
+			(double)BENCH_SERVLETS * BENCH_ACTIVATIONS / cost / 1e6,
+			(unsigned long long)stat.steals, (unsigned long long)stat.parks);
+	fflush(stdout);
+}
+
+int main(int argc, char **argv) {
+	int defaults[] = { 4, 16, 32 };
+	int n = argc > 1 ? argc - 1 : (int)SIZE(defaults);
+
+	printf("%8s %8s %16s %12s %12s\n", "workers", "mode", "M activations/s", "steals", "parks");
+	/* 子进程会继承未输出的缓冲 */
+	fflush(stdout);
+	for(int i=0; i<n; ++i) {
+		int workers = argc > 1 ? atoi(argv[i + 1]) : defaults[i];
+		for(int steal=0; steal<2; ++steal) {
+			pid_t pid = fork();
+			CHECK(pid >= 0);
+			if(0 == pid) {
+				bench_run(workers, steal);
+				/* 不等待worker退出 */
+				_exit(0);
+			}
+			waitpid(pid, NULL, 0);
+		}
+	}
+
+	return 0;
+}
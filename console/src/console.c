@@ -28,13 +28,18 @@ static inline int console_release(HANDLE service_handle) {
 	return ERROR_SUCCESS;
 }
 
+#define CONSOLE_BATCH_SIZE	16
+
 static inline int console_start(HANDLE service_handle) {
-	message *msg = service_pop_message(service_handle);
-	CHECK_VAILD_PTR(msg);
-	printf("recv cmd : %s\n", (const char *)msg->data);
-	if(MSG_IS_CPY(msg)) {
-		FREE(msg->data);
-		FREE(msg);
+	message *msgs[CONSOLE_BATCH_SIZE];
+	int count = service_pop_messages(service_handle, msgs, SIZE(msgs));
+	for(int i=0; i<count; ++i) {
+		message *msg = msgs[i];
+		printf("recv cmd : %s\n", (const char *)msg->data);
+		if(MSG_IS_CPY(msg) || MSG_IS_SHA(msg)) {
+			message_free_data(msg);
+			message_free(msg);
+		}
 	}
 
 	return ERROR_SUCCESS;
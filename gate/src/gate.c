@@ -8,6 +8,7 @@
 #include <define.h>
 #include <errcode.h>
 #include <context.h>
+#include <thread.h>
 #include <net.h>
 #include <service.h>
 
@@ -23,6 +24,8 @@ static inline int gate_init(HANDLE service_handle) {
 		ABORT
 	} else {
 		context_register_eventloop(loop);
+		/* init可能在启动图的worker上执行，loop由start所在的线程运行，worker不能保留loop的绑定 */
+		eventloop_release_owner(loop);
 	}
 
 
@@ -38,6 +41,7 @@ static inline int gate_release(HANDLE service_handle) {
 }
 
 static inline int gate_start(HANDLE service_handle) {
+	(void)threadpool_bind_loop();
 	eventloop_asgin_owner(loop);
 	eventloop_run_loop(loop);
 	return ERROR_SUCCESS;
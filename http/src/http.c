@@ -26,8 +26,9 @@ static inline int http_release(HANDLE service_handle) {
 	return ERROR_SUCCESS;
 }
 
-static inline int http_start(HANDLE service_handle) {
-	message *msg = service_pop_message(service_handle);
+#define HTTP_BATCH_SIZE	32
+
+static inline void http_handle_message(message *msg) {
 	buffer *buf = (buffer *)msg->data;
 	/*
 	LOGGER_RECORD_INFO
@@ -48,15 +49,23 @@ static inline int http_start(HANDLE service_handle) {
 		printf("port %d recv %zd bytes data(buffer)\n", msg->sockfd, buffer_get_readable(buf));
 		if(MSG_IS_CPY(msg)) {
 			buffer_destroy((buffer **)&msg->data);
-			FREE(msg);
+			message_free(msg);
 		}
 	} else if(msg->data) {
 		printf("port %d recv %zd bytes data(raw)\n", msg->sockfd, msg->size);
-		if(MSG_IS_CPY(msg)) {
-			FREE(msg->data);
-			FREE(msg);
+		if(MSG_IS_CPY(msg) || MSG_IS_SHA(msg)) {
+			message_free_data(msg);
+			message_free(msg);
 		}
 	}
+}
+
+static inline int http_start(HANDLE service_handle) {
+	message *msgs[HTTP_BATCH_SIZE];
+	int count = service_pop_messages(service_handle, msgs, SIZE(msgs));
+	for(int i=0; i<count; ++i) {
+		http_handle_message(msgs[i]);
+	}
 
 	return ERROR_SUCCESS;
 }
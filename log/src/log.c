@@ -29,19 +29,25 @@ static inline int log_release(HANDLE service_handle) {
 	return errcode;
 }
 
+#define LOG_BATCH_SIZE	32
+
 static inline int log_start(HANDLE service_handle) {
-	message *msg = service_pop_message(service_handle);
-	if(TEST_VAILD_PTR(msg)) {
+	message *msgs[LOG_BATCH_SIZE];
+	int count = service_pop_messages(service_handle, msgs, SIZE(msgs));
+	for(int i=0; i<count; ++i) {
+		message *msg = msgs[i];
 		char *record = msg->data;
 		LOGGER_SERVER_UNLOCK_STOR(record, msg->size)
-		LOGGER_SERVER_FLUSH
-		if(MSG_IS_CPY(msg)) {
-			FREE(msg->data);
-			FREE(msg);
+		if(MSG_IS_CPY(msg) || MSG_IS_SHA(msg)) {
+			message_free_data(msg);
+			message_free(msg);
 		}
 	}
 
-
+	/* 一批记录只刷新一次 */
+	if(count > 0) {
+		LOGGER_SERVER_FLUSH
+	}
 
 	return ERROR_SUCCESS;
 }
@@ -29,8 +29,23 @@
 #define ATOM_NAND_NEW(ptr,n) __sync_nand_and_fetch(ptr, n)
 #define ATOM_NAND_OLD(ptr,n) __sync_fetch_and_nand(ptr, n)
 
+#define ATOM_XCHG(ptr, nval) __atomic_exchange_n(ptr, nval, __ATOMIC_ACQ_REL)
+#define ATOM_LOAD_ACQ(ptr) __atomic_load_n(ptr, __ATOMIC_ACQUIRE)
+#define ATOM_STORE_REL(ptr, nval) __atomic_store_n(ptr, nval, __ATOMIC_RELEASE)
+
+#define ATOM_LOAD(ptr) __atomic_load_n(ptr, __ATOMIC_RELAXED)
+
 #define FULL_BARRIER() __sync_synchronize()
 
+/* 自旋等待时降低功耗并让出流水线给同核的另一个超线程 */
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_PAUSE() __builtin_ia32_pause()
+#elif defined(__aarch64__) || defined(__arm__)
+#define CPU_PAUSE() __asm__ __volatile__("yield" ::: "memory")
+#else
+#define CPU_PAUSE() __asm__ __volatile__("" ::: "memory")
+#endif
+
 typedef struct {
     volatile int counter;
 } atomic_t;
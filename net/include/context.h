@@ -8,8 +8,13 @@
 #ifndef __QNODE_CONTEXT_H__
 #define __QNODE_CONTEXT_H__
 
+#include <stdint.h>
+
 #include <define.h>
 
+/* 高优先级通道连续处理的最大邮件数，之后让普通通道处理一封 */
+#define MAILBOX_PRIO_BURST	16
+
 FORWARD_DECLAR(message)
 FORWARD_DECLAR(context)
 FORWARD_DECLAR(net_eventloop)
@@ -24,7 +29,45 @@ void context_release();
 int context_register_mailbox(HANDLE handle);
 void context_unregister_mailbox(HANDLE handle);
 void context_send_mail(HANDLE handle, message *msg);
+/* msgs一次投递到同一个邮箱，每个通道只同步一次，最多触发一次调度 */
+void context_send_mails(HANDLE handle, message *msgs[], int n);
 message *context_recv_mail(HANDLE handle);
 message *context_try_recv_mail(HANDLE handle);
+/* 非阻塞，最多取出max封邮件，返回实际取出的数量 */
+int context_try_recv_mails(HANDLE handle, message *msgs[], int max);
 bool context_has_mail(HANDLE handle);
+/* 尚未取出的邮件数 */
+size_t context_get_mail_depth(HANDLE handle);
+/* 阻塞收取邮件时的空闲策略：先自旋spin次，再让出cpu yield次，之后睡眠 */
+void context_set_mailbox_idle(HANDLE handle, int spin, int yield);
+/* 消费者睡眠次数和生产者唤醒的系统调用次数 */
+void context_get_mailbox_idle_stat(HANDLE handle, uint64_t *parks, uint64_t *wakes);
+/* *
+ * CoDel丢弃策略：停留时间持续超过target达interval后开始丢弃，丢弃的邮件转入trash
+ * target为0时关闭
+ * */
+void context_set_mailbox_codel(HANDLE handle, double target_s, double interval_s);
+void context_get_mailbox_codel(HANDLE handle, double *target_s, double *interval_s, uint64_t *drops);
+/* mailbox的调度状态，保证一个servlet同一时刻最多被调度一次 */
+typedef enum {
+	MAIL_IDLE,			/* 空闲 */
+	MAIL_SCHEDULED,		/* 已进入就绪队列或任务队列 */
+	MAIL_RUNNING			/* 正在worker中执行 */
+} mail_state;
+
+/* *
+ * 取出一个就绪的mailbox handle，超时返回INVAILD_SERVICE_HANDLE
+ * trash mailbox收到邮件时也会提前返回INVAILD_SERVICE_HANDLE
+ * */
+HANDLE context_wait_ready(double timeout_s);
+/* 主线程在就绪队列上的睡眠次数和生产者唤醒的系统调用次数 */
+void context_get_ready_idle_stat(uint64_t *parks, uint64_t *wakes);
+/* 持有调度权的handle重新放回就绪队列 */
+void context_post_ready(HANDLE handle);
+/* 只清除调度状态，下一封邮件到达时重新入队 */
+void context_reset_ready(HANDLE handle);
+/* worker开始执行 */
+void context_run_ready(HANDLE handle);
+/* 执行结束，仍有消息且重新获得调度权时返回true，调用者负责再次调度 */
+bool context_finish_ready(HANDLE handle);
 #endif /* __QNODE_CONTEXT_H__ */
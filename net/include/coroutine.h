@@ -0,0 +1,58 @@
+/*
+ * coroutine.h
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+
+#ifndef __QNODE_COROUTINE_H__
+#define __QNODE_COROUTINE_H__
+
+#include <stdint.h>
+
+#include <define.h>
+
+/* *
+ * 基于ucontext的有栈协程
+ * 协程由resume同步运行，直到yield或者函数返回才回到resume的调用者，resume可以嵌套
+ * 挂起的协程可以在另一个线程中恢复，协程内不要跨yield持有线程局部变量的地址或者epoch临界区
+ * 协程对象和栈一起缓存复用，栈底有保护页
+ * */
+#define COROUTINE_STACK_SIZE	(64 * 1024)
+#define COROUTINE_POOL_MAX	1024		/* 最多缓存的空闲协程数 */
+
+typedef void (*coroutine_fn)(void *args);
+
+typedef enum coroutine_state {
+	COROUTINE_READY = 0,		/* 创建之后尚未运行 */
+	COROUTINE_RUNNING,
+	COROUTINE_SUSPENDED,
+	COROUTINE_DEAD			/* 函数已返回 */
+} coroutine_state;
+
+typedef struct coroutine_pool_stat {
+	uint64_t created;		/* 新分配的协程数(包括栈) */
+	uint64_t reused;			/* 从缓存取得的次数 */
+	uint64_t switches;		/* 上下文切换次数 */
+	int active;				/* 正在使用的协程数 */
+	int cached;				/* 缓存的空闲协程数 */
+} coroutine_pool_stat;
+
+FORWARD_DECLAR(coroutine)
+
+/* Public functions. */
+coroutine *coroutine_create(coroutine_fn fn, void *args);
+/* 不能销毁正在运行的协程，挂起的协程直接丢弃，对象回到缓存 */
+void coroutine_destroy(coroutine *co);
+/* 运行co直到其挂起或结束，返回之后的状态 */
+coroutine_state coroutine_resume(coroutine *co);
+/* 挂起当前协程，回到resume的调用者 */
+void coroutine_yield();
+/* 当前线程正在运行的协程，不在协程中返回NULL */
+coroutine *coroutine_current();
+coroutine_state coroutine_get_state(coroutine *co);
+void coroutine_pool_get_stat(coroutine_pool_stat *stat);
+/* 释放缓存的空闲协程 */
+void coroutine_pool_release();
+
+#endif /* __QNODE_COROUTINE_H__ */
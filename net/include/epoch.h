@@ -0,0 +1,41 @@
+/*
+ * epoch.h
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+
+#ifndef __QNODE_EPOCH_H__
+#define __QNODE_EPOCH_H__
+
+#include <stdint.h>
+
+#include <define.h>
+
+/* *
+ * 基于epoch的延迟回收
+ * 读者在epoch_enter/epoch_leave之间无锁访问共享指针，临界区可以嵌套
+ * 写者先撤下指针，再用epoch_retire登记旧对象，
+ * 当所有在登记之前进入临界区的读者都离开后才真正释放
+ * */
+typedef void (*epoch_free_fn)(void *ptr);
+
+typedef struct epoch_stat {
+	uint64_t epoch;			/* 当前全局epoch */
+	uint64_t retired;		/* 登记的对象总数 */
+	uint64_t reclaimed;		/* 已释放的对象总数 */
+	int threads;			/* 参与的线程数 */
+} epoch_stat;
+
+/* Public functions. */
+void epoch_enter();
+void epoch_leave();
+/* ptr已经对新的读者不可见，由free_fn延迟释放 */
+void epoch_retire(void *ptr, epoch_free_fn free_fn);
+/* 尝试推进epoch并释放已安全的对象，返回本次释放的个数 */
+int epoch_reclaim();
+/* 释放全部登记的对象，只能在没有读者时调用 */
+void epoch_release();
+void epoch_get_stat(epoch_stat *stat);
+
+#endif /* __QNODE_EPOCH_H__ */
@@ -46,5 +46,9 @@
 #define ERROR_NOTSOCK				ERROR_CODE_OFFSET(ERROR_NET_BASE, 12)
 #define ERROR_OPNOTSUPP				ERROR_CODE_OFFSET(ERROR_NET_BASE, 13)
 
+/* rpc error code */
+#define ERROR_RPC_BASE				0x0500
+#define ERROR_TIMEOUT				ERROR_CODE_OFFSET(ERROR_RPC_BASE, 1)
+
 const char* strerror_tl(int errcode);
 #endif /* __QNODE_INCLUDE_ERRCODE_H__ */
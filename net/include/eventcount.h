@@ -0,0 +1,103 @@
+/*
+ * eventcount.h
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+
+#ifndef __QNODE_EVENTCOUNT_H__
+#define __QNODE_EVENTCOUNT_H__
+
+#include <sched.h>
+#include <limits.h>
+
+#include <define.h>
+#include <atomic.h>
+#include <futex.h>
+
+/* *
+ * 空闲策略：先忙等spin次，再让出cpu yield次，之后才睡眠
+ * spin和yield都为0时立即睡眠
+ * */
+typedef struct idle_strategy {
+	int spin;
+	int yield;
+} idle_strategy;
+
+#define IDLE_SPIN_DEFAULT	256
+#define IDLE_YIELD_DEFAULT	4
+
+static inline void idle_strategy_init(idle_strategy *idle, int spin, int yield) {
+	idle->spin = MAX(spin, 0);
+	idle->yield = MAX(yield, 0);
+}
+
+/* 第round次空转，返回false表示应该睡眠 */
+static inline bool idle_strategy_backoff(const idle_strategy *idle, int round) {
+	if(round < idle->spin) {
+		CPU_PAUSE();
+		return true;
+	}
+	if(round < idle->spin + idle->yield) {
+		sched_yield();
+		return true;
+	}
+
+	return false;
+}
+
+/* *
+ * eventcount，条件由调用者自己检查
+ * 消费者：key = eventcount_prepare(); 再次检查条件;
+ *        满足则eventcount_cancel()，否则eventcount_wait(key)
+ * 生产者：修改状态后调用eventcount_notify，没有睡眠者时不进入内核
+ * */
+typedef struct eventcount {
+	int seq;
+	int waiters;
+	uint64_t parks;		/* 睡眠次数 */
+	uint64_t wakes;		/* 唤醒系统调用次数 */
+} eventcount;
+
+static inline void eventcount_init(eventcount *ec) {
+	ec->seq = 0;
+	ec->waiters = 0;
+	ec->parks = 0;
+	ec->wakes = 0;
+}
+
+static inline int eventcount_prepare(eventcount *ec) {
+	/* 原子加是完整屏障，之后的条件检查不会被提前 */
+	ATOM_INC_NEW(&ec->waiters);
+	return ATOM_LOAD_ACQ(&ec->seq);
+}
+
+static inline void eventcount_cancel(eventcount *ec) {
+	ATOM_DEC_NEW(&ec->waiters);
+}
+
+/* timeout_s < 0 永久等待 */
+static inline void eventcount_wait(eventcount *ec, int key, double timeout_s) {
+	ATOM_INC_NEW(&ec->parks);
+	futex_wait_timeout(&ec->seq, key, timeout_s);
+	ATOM_DEC_NEW(&ec->waiters);
+}
+
+/* 唤醒最多n个睡眠者，返回是否进入了内核 */
+static inline bool eventcount_notify(eventcount *ec, int n) {
+	/* 状态的修改必须先于waiters的读取 */
+	FULL_BARRIER();
+	if(likely(0 == ATOM_LOAD(&ec->waiters)))
+		return false;
+
+	ATOM_INC_NEW(&ec->seq);
+	ATOM_INC_NEW(&ec->wakes);
+	futex_wake(&ec->seq, n);
+	return true;
+}
+
+static inline bool eventcount_notify_all(eventcount *ec) {
+	return eventcount_notify(ec, INT_MAX);
+}
+
+#endif /* __QNODE_EVENTCOUNT_H__ */
@@ -0,0 +1,37 @@
+/*
+ * futex.h
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+
+#ifndef __QNODE_FUTEX_H__
+#define __QNODE_FUTEX_H__
+
+#include <define.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* *addr == val时睡眠，直到被唤醒；只用于进程内同步 */
+static inline int futex_wait(volatile int *addr, int val) {
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+/* timeout_s < 0 永久等待 */
+static inline int futex_wait_timeout(volatile int *addr, int val, double timeout_s) {
+	if(timeout_s < 0)
+		return futex_wait(addr, val);
+
+	struct timespec ts;
+	ts.tv_sec = (time_t)timeout_s;
+	ts.tv_nsec = (long)((timeout_s - ts.tv_sec) * 1000000000);
+	return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, &ts, NULL, 0);
+}
+
+/* 最多唤醒n个等待者，返回实际唤醒的个数 */
+static inline int futex_wake(volatile int *addr, int n) {
+	return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+#endif /* __QNODE_FUTEX_H__ */
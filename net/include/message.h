@@ -15,18 +15,26 @@ typedef enum {
 	MSG_REQ = 2,
 	MSG_REP = 4,
 	MSG_CPY = 8,
-	MSG_SHA = 16
+	MSG_SHA = 16,
+	MSG_INL = 32,			/* data指向消息内联存储，不能单独释放 */
+	MSG_PRI = 64			/* 控制消息，进入邮箱的高优先级通道 */
 } message_type;
 
+/* 小于等于该大小的payload直接存放在message内部 */
+#define MSG_INLINE_SIZE	64
+
 typedef struct message {
 	int type;
 	uint32_t source;		/* 对于raw类型的消息source表示ip地址，而rpc类型的消息source表示service_id = node_id << 16 & service_handle */
 	int session;			/* 对于raw类型的消息session永远为0 */
+	uint32_t enqueue;		/* 进入邮箱的时刻(微秒时钟低32位)，邮箱开启CoDel时才设置，0表示未设置 */
 	void *data;
 	size_t size;
 	queue_node node;
 	int errcode;			/* RPC类型有效 */
 	int sockfd;			/* 注册端口的有效 */
+	void *pool;			/* 分配该消息的线程消息池 */
+	char payload[MSG_INLINE_SIZE] __attribute__((aligned(64)));	/* 内联payload，紧跟在消息头之后的cache line */
 } message;
 
 #define MSG_IS_RAW(msg)		(!!((msg->type) & MSG_RAW))
@@ -34,14 +42,144 @@ typedef struct message {
 #define MSG_IS_REP(msg)		(!!((msg->type) & MSG_REP))
 #define MSG_IS_CPY(msg)		(!!((msg->type) & MSG_CPY))
 #define MSG_IS_SHA(msg)		(!!((msg->type) & MSG_SHA))
+#define MSG_IS_INL(msg)		(!!((msg->type) & MSG_INL))
+#define MSG_IS_PRI(msg)		(!!((msg->type) & MSG_PRI))
+
+/* *
+ * 引用计数的共享payload，头部和数据一次分配
+ * 带MSG_SHA的消息data指向payload->data，每条消息持有一个引用，由message_free_data释放
+ * 接收者只能读取共享的数据
+ * */
+#define SHARED_PAYLOAD_MAGIC	0x51534841
+
+typedef struct shared_payload {
+	uint32_t magic;
+	int refs;
+	size_t size;
+	char data[] __attribute__((aligned(16)));
+} shared_payload;
 
 typedef void(* call_success_cb)(message *msg);
 typedef void(* call_faild_cb)(message *msg);
 
+/* *
+ * qcall_many的结果，replies按请求顺序排列，未到达的成员为NULL
+ * 回调负责释放replies中的消息，result本身在回调返回后释放
+ * */
+typedef struct call_many_result {
+	int size;
+	int arrived;				/* 收到应答的成员数 */
+	int errcode;				/* 全部到达为ERROR_SUCCESS，有成员超时或发送失败为ERROR_TIMEOUT */
+	void *ud;
+	message **replies;
+} call_many_result;
+
+typedef void(* call_many_cb)(call_many_result *result);
+
+/* qcall的默认超时(秒)，超时后以ERROR_TIMEOUT调用call_faild_cb */
+#define DEFAULT_CALL_TIMEOUT	30.0
+
+/* 会话表统计 */
+typedef struct session_stat {
+	uint64_t calls;			/* 发起的调用数 */
+	uint64_t timeouts;		/* 超时的调用数 */
+	uint64_t lates;			/* 超时之后才到达的应答数 */
+	size_t live;				/* 等待应答的调用数 */
+	size_t capacity;			/* 已分配的槽位数 */
+} session_stat;
+
+/* 消息池统计 */
+typedef struct message_pool_stat {
+	uint64_t alloc;			/* message_alloc调用次数 */
+	uint64_t hit;			/* 从空闲链表直接取得的次数 */
+	uint64_t slab;			/* 新分配slab的次数 */
+	uint64_t local_free;		/* 本线程归还次数 */
+	uint64_t remote_free;	/* 其他线程归还次数 */
+	int pools;				/* 线程消息池个数 */
+	int orphans;				/* 等待领养的消息池个数 */
+} message_pool_stat;
+
+message *message_alloc();
+void message_free(message *msg);
+/* 分配size字节的payload，小消息使用内联存储，data/size已设置 */
+message *message_alloc_payload(size_t size);
+/* 释放data，内联payload不做处理 */
+void message_free_data(message *msg);
+void message_pool_get_stat(message_pool_stat *stat);
+/* 拷贝size字节生成共享payload，引用计数为1，size为0时返回NULL */
+shared_payload *payload_create(const void *data, size_t size);
+shared_payload *payload_retain(shared_payload *payload);
+void payload_release(shared_payload *payload);
+/* 由MSG_SHA消息的data得到所在的payload */
+shared_payload *payload_of(const void *data);
+/* 命中率 = hit / alloc */
+double message_pool_hit_rate();
+
 message *quick_gen_msg(HANDLE self, int session, void *data, size_t size, int type);
+message *quick_gen_msg_copy(HANDLE self, int session, const void *data, size_t size, int type);
+/* share为true时data必须是payload->data，调用者持有的一个引用随消息转移 */
 int qsend(const char*sname, void *data, size_t size, bool share);
+/* 同一个key总是投递到分片服务的同一个实例，非分片服务等同于qsend */
+int qsend_key(const char*sname, uint64_t key, void *data, size_t size, bool share);
+/* 拷贝data，调用者保留data的所有权 */
+int qsend_copy(const char*sname, const void *data, size_t size);
 int qcall(const char*sname, void *data, size_t size,
 		call_success_cb scb, call_faild_cb fcb);
+/* 直接按handle投递，热路径上可缓存service_get_handle的结果 */
+int qsend_handle(HANDLE peer, void *data, size_t size, bool share);
+/* 走对方邮箱的高优先级通道，用于控制命令等不能排在批量数据之后的消息 */
+int qsend_prio(const char*sname, void *data, size_t size, bool share);
+int qsend_handle_prio(HANDLE peer, void *data, size_t size, bool share);
+/* 已经生成的n条消息一次性投递给peer，邮箱只同步一次、最多唤醒一次 */
+int qsend_batch(HANDLE peer, message *msgs[], int n);
+/* *
+ * 在loop线程中暂存，本轮事件循环结束时按目标合并为qsend_batch
+ * 不在loop线程中调用时等同于qsend_handle
+ * */
+int qsend_buffered(HANDLE peer, void *data, size_t size, bool share);
+/* 暂存已经生成的消息，网络层把解包得到的消息按连接所在的loop合并投递 */
+int qsend_buffered_msg(HANDLE peer, message *msg);
+/* 立即提交本线程暂存的消息 */
+void qsend_flush();
+/* *
+ * 每个接收者一条轻量消息，共享payload的数据，调用者保留自己的引用
+ * 返回成功投递的接收者个数
+ * */
+int qmulticast(const HANDLE peers[], int n, shared_payload *payload);
+/* 发送给除自己以外的全部servlet，返回值同qmulticast */
+int qbroadcast(shared_payload *payload);
+int qcall_handle(HANDLE peer, void *data, size_t size,
+		call_success_cb scb, call_faild_cb fcb);
+/* *
+ * timeout <= 0 表示不超时
+ * 返回ERROR_FAILD时请求没有发出，data仍归调用者；成功时data归接收方
+ * */
+int qcall_timeout(const char*sname, void *data, size_t size, double timeout,
+		call_success_cb scb, call_faild_cb fcb);
+int qcall_handle_timeout(HANDLE peer, void *data, size_t size, double timeout,
+		call_success_cb scb, call_faild_cb fcb);
+/* *
+ * 并发调用n个服务，共用一个截止时间，全部应答到达或超时后调用一次cb
+ * 与qcall一样，cb在完成调用组的线程中执行：最后一个应答者或者超时扫描的loop线程
+ * datas/sizes可以为NULL，各成员的data所有权与qcall相同
+ * */
+int qcall_many(const char *snames[], void *datas[], const size_t sizes[], int n,
+		double timeout, call_many_cb cb, void *ud);
+int qcall_many_handle(const HANDLE peers[], void *datas[], const size_t sizes[], int n,
+		double timeout, call_many_cb cb, void *ud);
+/* *
+ * 只能在协程模式服务的协程中调用，挂起直到应答到达，不占用worker线程
+ * timeout <= 0 时使用DEFAULT_CALL_TIMEOUT，挂起的协程总会被恢复
+ * 返回应答消息(errcode为对方的返回值或ERROR_TIMEOUT)，由调用者释放
+ * 请求发出之后data归接收方；返回NULL表示没有发出(不能挂起或者登记会话失败)，data仍归调用者
+ * */
+message *qcall_await(const char*sname, void *data, size_t size, double timeout);
+message *qcall_handle_await(HANDLE peer, void *data, size_t size, double timeout);
+/* *
+ * 返回ERROR_FAILD时应答没有生成，data仍归调用者
+ * 调用方已经超时返回ERROR_TIMEOUT，迟到的应答连同data一起释放
+ * */
 int qreturn(HANDLE peer, int err, void *data,
 		size_t size, int session);
+void session_get_stat(session_stat *stat);
 #endif /* __QNODE_MESSAGE_H__ */
@@ -40,11 +40,14 @@ net_timerid eventloop_settimer_after(net_eventloop *loop,
 net_timerid eventloop_settimer_every(net_eventloop *loop,
 		double interval, pending_entry entry);
 bool eventloop_cancel_timer(net_eventloop *loop, net_timerid timerId);
+/* 注册每轮循环结束时的回调，只能在loop线程中调用 */
+void eventloop_add_flush(net_eventloop *loop, pending_entry entry);
 bool eventloop_has_channel(net_eventloop *loop, net_channel* channel);
 void eventloop_update_channel(net_eventloop *loop, net_channel* channel);
 void eventloop_remove_channel(net_eventloop *loop, net_channel* channel);
 void eventloop_do_pendingfunc(net_eventloop *loop);
 void eventloop_run_loop(net_eventloop *loop);
 void eventloop_asgin_owner(net_eventloop *loop);
+void eventloop_release_owner(net_eventloop *loop);
 
 #endif /* __QNODE_NET_EVENTLOOP_H__ */
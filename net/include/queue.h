@@ -9,11 +9,13 @@
 #define __QNODE_QUEUE_H__
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 
 #include <list.h>
 #include <spinlock.h>
 #include <condition.h>
+#include <eventcount.h>
 
 typedef dclist_node queue_node;
 typedef void(* queue_node_free_cb)(queue_node *);
@@ -68,6 +70,44 @@ void block_queue_clear(block_queue *q, queue_node_free_cb free_cb);
 /* 非线程安全 */
 void block_queue_destroy(block_queue **q, queue_node_free_cb free_cb);
 
+/* *
+ * 无锁多生产者单消费者队列(侵入式，复用queue_node.next)
+ * 队列为空时消费者按idle策略先自旋、让出cpu，最后在eventcount上睡眠
+ * 生产者只在消费者睡眠时才进入内核唤醒
+ * 多个队列可以attach到同一个owner，由一个消费者在owner的eventcount上等待全部队列
+ * */
+typedef struct mpsc_queue {
+	queue_node *head;			/* 生产者端 */
+	char pad[64];				/* 避免生产者和消费者伪共享 */
+	queue_node *tail;			/* 消费者端 */
+	queue_node stub;
+	atomic_t size;
+	eventcount ec;
+	idle_strategy idle;
+	bool finish;
+	struct mpsc_queue *owner;	/* 入队时唤醒owner上的等待者，默认是自己 */
+} mpsc_queue;
+
+mpsc_queue *mpsc_queue_create();
+int mpsc_queue_empty(const mpsc_queue *q);
+int mpsc_queue_size(const mpsc_queue *q);
+bool mpsc_queue_push(mpsc_queue *q, queue_node *node);
+/* first到last已经用next链接好的n个节点一次入队，只唤醒一次 */
+bool mpsc_queue_push_batch(mpsc_queue *q, queue_node *first, queue_node *last, int n);
+/* 以下接口只能由唯一的消费者调用 */
+queue_node *mpsc_queue_pop(mpsc_queue *q);
+queue_node *mpsc_queue_try_pop(mpsc_queue *q);
+void mpsc_queue_finish(mpsc_queue *q);
+/* q的入队通知转给owner，必须在有生产者之前调用 */
+void mpsc_queue_attach(mpsc_queue *q, mpsc_queue *owner);
+/* 按owner(qs[0])的idle策略等待，直到任意一个队列非空，qs[0]结束且全部为空时返回false */
+bool mpsc_queue_wait_any(mpsc_queue *qs[], int n);
+void mpsc_queue_set_idle(mpsc_queue *q, int spin, int yield);
+void mpsc_queue_get_idle_stat(const mpsc_queue *q, uint64_t *parks, uint64_t *wakes);
+void mpsc_queue_clear(mpsc_queue *q, queue_node_free_cb free_cb);
+/* 非线程安全 */
+void mpsc_queue_destroy(mpsc_queue **q, queue_node_free_cb free_cb);
+
 typedef struct {
 	queue_node queue_head;
 	mutex lock;
@@ -75,6 +115,7 @@ typedef struct {
 	condition no_full;
 	int size;
 	int capacity;
+	int waiting;				/* 等待no_empty的线程数，没有等待者时push不通知 */
 	bool finish;
 } bound_block_queue;
 
@@ -84,11 +125,41 @@ int bound_block_queue_full(const bound_block_queue *q);
 int bound_block_queue_capacity(const bound_block_queue *q);
 int bound_block_queue_size(const bound_block_queue *q);
 bool bound_block_queue_push(bound_block_queue *q, queue_node *node);
+bool bound_block_queue_try_push(bound_block_queue *q, queue_node *node);
 queue_node *bound_block_queue_pop(bound_block_queue *q);
+queue_node *bound_block_queue_try_pop(bound_block_queue *q);
 void bound_block_queue_finish(bound_block_queue *q);
 void bound_block_queue_set_capacity(bound_block_queue *q, int capacity);
 void bound_block_queue_clear(bound_block_queue *q, queue_node_free_cb free_cb);
 /* 非线程安全 */
 void bound_block_queue_destroy(bound_block_queue **q, queue_node_free_cb free_cb);
 
+/* *
+ * Chase-Lev工作窃取双端队列(侵入式指针数组)
+ * 所有者在bottom端push/pop，其他线程在top端steal
+ * 数组满时扩容为两倍，旧数组可能仍被窃取者读取，保留到destroy时释放
+ * */
+typedef struct ws_array {
+	int64_t capacity;			/* 2的幂 */
+	struct ws_array *prev;
+	queue_node *buffer[];
+} ws_array;
+
+typedef struct {
+	volatile int64_t top;		/* 窃取端 */
+	char pad[64];				/* 避免所有者和窃取者伪共享 */
+	volatile int64_t bottom;	/* 所有者端 */
+	ws_array *array;
+} ws_deque;
+
+ws_deque *ws_deque_create(int capacity);
+int ws_deque_size(const ws_deque *q);
+/* 以下两个接口只能由所有者调用 */
+bool ws_deque_push(ws_deque *q, queue_node *node);
+queue_node *ws_deque_pop(ws_deque *q);
+/* 任意线程调用，竞争失败时返回NULL */
+queue_node *ws_deque_steal(ws_deque *q);
+/* 非线程安全 */
+void ws_deque_destroy(ws_deque **q, queue_node_free_cb free_cb);
+
 #endif /* __QNODE_QUEUE_H__ */
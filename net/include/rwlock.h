@@ -20,6 +20,8 @@
 #ifndef USE_PTHREAD_RWLOCK
 #include <atomic.h>
 
+#ifdef USE_LEGACY_RWLOCK
+/* 旧的实现，只用于对比测试 */
 typedef struct {
 	int write;
 	int read;
@@ -63,6 +65,105 @@ static inline void rwlock_runlock(rwlock *lock) {
 	ATOM_DEC_NEW(&lock->read);
 }
 
+#else
+
+#include <limits.h>
+#include <futex.h>
+
+/* *
+ * 写优先：写者先占住write，再等待已进入的读者离开
+ * 等待时先只读自旋并指数退避，超过自旋次数后在seq上睡眠
+ * 有睡眠者时，任何可能让等待者前进的状态变化都会递增seq并唤醒全部
+ * */
+#define RWLOCK_SPIN_LIMIT		16		/* 退避轮数 */
+#define RWLOCK_BACKOFF_MAX		64		/* 单轮最多pause次数 */
+
+typedef struct {
+	int write;
+	int read;
+	int seq;			/* 状态变化序号，futex等待在此 */
+	int waiters;		/* 睡眠中的线程数 */
+} rwlock;
+
+static inline void
+rwlock_init(rwlock *lock) {
+	lock->write = 0;
+	lock->read = 0;
+	lock->seq = 0;
+	lock->waiters = 0;
+}
+
+/* 调用前状态修改与读取waiters之间必须有完整的内存屏障 */
+static inline void rwlock_wake(rwlock *lock) {
+	if(unlikely(0 != ATOM_LOAD(&lock->waiters))) {
+		ATOM_INC_NEW(&lock->seq);
+		futex_wake(&lock->seq, INT_MAX);
+	}
+}
+
+/* 等待*busy变为0 */
+static inline void rwlock_wait(rwlock *lock, int *busy) {
+	int backoff = 1;
+	for(int spin=0; spin<RWLOCK_SPIN_LIMIT; ++spin) {
+		if(0 == ATOM_LOAD(busy))
+			return;
+		for(int i=0; i<backoff; ++i) {
+			CPU_PAUSE();
+		}
+		backoff = MIN(backoff << 1, RWLOCK_BACKOFF_MAX);
+	}
+
+	while(0 != ATOM_LOAD(busy)) {
+		int seq = ATOM_LOAD_ACQ(&lock->seq);
+		ATOM_INC_NEW(&lock->waiters);
+		/* 先登记再检查，与rwlock_wake配对，不会丢失唤醒 */
+		if(0 != ATOM_LOAD(busy)) {
+			futex_wait(&lock->seq, seq);
+		}
+		ATOM_DEC_NEW(&lock->waiters);
+	}
+}
+
+static inline void rwlock_runlock(rwlock *lock) {
+	/* 最后一个读者离开时写者可能在等待 */
+	if(0 == ATOM_DEC_NEW(&lock->read) && 0 != ATOM_LOAD(&lock->write)) {
+		rwlock_wake(lock);
+	}
+}
+
+static inline void
+rwlock_rlock(rwlock *lock) {
+	for (;;) {
+		if(unlikely(0 != ATOM_LOAD(&lock->write))) {
+			rwlock_wait(lock, &lock->write);
+		}
+		ATOM_INC_NEW(&lock->read);
+		if (likely(0 == ATOM_LOAD(&lock->write))) {
+			break;
+		}
+		rwlock_runlock(lock);
+	}
+}
+
+static inline void
+rwlock_wlock(rwlock *lock) {
+	while(0 != ATOM_LOAD(&lock->write) || ATOM_SET_OLD(&lock->write, 1)) {
+		rwlock_wait(lock, &lock->write);
+	}
+	if(0 != ATOM_LOAD(&lock->read)) {
+		rwlock_wait(lock, &lock->read);
+	}
+}
+
+static inline void
+rwlock_wunlock(rwlock *lock) {
+	ATOM_RESET(&lock->write);
+	FULL_BARRIER();
+	rwlock_wake(lock);
+}
+
+#endif /* USE_LEGACY_RWLOCK */
+
 static inline void rwlock_destroy(rwlock *lock) {
 	IGNORE(lock);
 }
@@ -16,6 +16,32 @@
 
 #define SERVICE_STAGE_MAX	16
 
+/* 分片实例数上限和实例名(sname#i)的最大长度 */
+#define MAX_SERVICE_INSTANCES	256
+#define MAX_SERVICE_NAME			64
+
+/* service_route的key取该值时按轮询选择实例 */
+#define SERVICE_ROUTE_RR			UINT64_MAX
+
+/* servlet单次调度默认最多处理的消息数和时间(秒) */
+#define DEFAULT_DISPATCH_MSG_BUDGET		64
+#define DEFAULT_DISPATCH_TIME_BUDGET		0.002
+
+/* 邮箱积压的默认高低水位(消息数)，超过高水位时停止读取该服务的连接 */
+#define DEFAULT_MAILBOX_HIGH_WATER		8192
+#define DEFAULT_MAILBOX_LOW_WATER		2048
+
+/* *
+ * servlet公平调度权重，时间片和消息预算按weight/SERVICE_WEIGHT_DEFAULT缩放
+ * 饱和时各servlet占用的worker时间与权重成正比
+ * */
+#define SERVICE_WEIGHT_DEFAULT		10
+#define SERVICE_WEIGHT_MAX			1000
+
+/* CoDel的常用参数(秒)，默认不开启 */
+#define DEFAULT_CODEL_TARGET			0.005
+#define DEFAULT_CODEL_INTERVAL		0.1
+
 typedef enum {
 	SIG_SERVICE_INIT,
 	SIG_SERVICE_START,
@@ -47,6 +73,20 @@ typedef struct {
 	unpake_fn fn;
 } service_protocol;
 
+typedef struct service_codel_stat {
+	double target;			/* 秒，0表示未开启 */
+	double interval;		/* 秒 */
+	uint64_t drops;			/* 转入trash的消息数 */
+} service_codel_stat;
+
+typedef struct service_sched_stat {
+	int weight;
+	uint64_t activations;	/* 实际运行的调度次数 */
+	uint64_t skips;			/* 额度不足而让出的次数 */
+	double run_time;		/* 累计运行时间(秒) */
+	double max_slice;		/* 单次调度最长运行时间(秒) */
+} service_sched_stat;
+
 FORWARD_DECLAR(logger)
 
 int service_init();
@@ -61,15 +101,51 @@ unpake_fn service_query_unpack(const char *name);
 int service_config_protocol(uint16_t port, const char *name);
 int service_register_port(HANDLE service_handle, uint16_t port, const char *proto);
 int service_boost(const char *sname);
+/* *
+ * 启动instances个分片实例，各自拥有mailbox和handle，模块的全局状态仍然共享
+ * 按名字发送的消息轮询分发，端口上的消息按连接fd分发
+ * */
+int service_boost_instances(const char *sname, int instances);
+/* 分片服务按key选择实例，非分片服务原样返回 */
+HANDLE service_route(HANDLE service_handle, uint64_t key);
 int service_batch_boost(const char *service_batch[][SERVICE_STAGE_MAX]);
+/* 每行{ 服务名, 依赖..., NULL }，相互独立的服务并行init，结束时打印各服务启动耗时 */
+int service_graph_boost(const char *service_graph[][SERVICE_STAGE_MAX]);
 void service_stop(const char *sname, HANDLE service_handle);
 HANDLE service_get_handle(const char *sname);
+int service_register_alias(HANDLE service_handle, const char *alias);
 logger *service_get_logger(HANDLE service_handle);
 uint32_t service_get_harborid(HANDLE handle);
 int service_wait(const char *sname, STAGE_TYPE type, service_state state, double timeout_s);
 int service_batch_wait(const char *snames[], STAGE_TYPE type, service_state state, double timeout_s);
-void service_push_message(HANDLE service_handle, message *msg);
+/* 投递到已注册服务的邮箱时返回true，否则msg转入trash回收 */
+bool service_push_message(HANDLE service_handle, message *msg);
+/* 从from开始按顺序取得最多max个type类型的已注册服务的handle，返回个数 */
+int service_list(HANDLE from, service_type type, HANDLE handles[], int max);
+/* 一批消息一次性投递到同一个服务，投递之后检查一次高水位 */
+void service_push_messages(HANDLE service_handle, message *msgs[], int n);
 message *service_pop_message(HANDLE service_handle);
+int service_pop_messages(HANDLE service_handle, message *msgs[], int max);
+void service_set_dispatch_budget(HANDLE service_handle, int msgs, double seconds);
+/* high为0时关闭流控 */
+void service_set_watermark(HANDLE service_handle, int high, int low);
+void service_set_weight(HANDLE service_handle, int weight);
+void service_get_sched_stat(HANDLE service_handle, service_sched_stat *stat);
+/* 打印各servlet的运行时间和占比，用于调整权重 */
+void service_sched_report();
+/* 开启CoDel丢弃，target为0时关闭 */
+void service_set_codel(HANDLE service_handle, double target, double interval);
+void service_get_codel_stat(HANDLE service_handle, service_codel_stat *stat);
+/* *
+ * 开启协程模式，只能在servlet的SIG_SERVICE_INIT中调用
+ * 之后SIG_SERVICE_START在协程中执行，可以使用qcall_await等待应答而不占用worker
+ * 同一服务的消息处理可能交错，模块需要按消息维护自己的状态
+ * */
+int service_enable_coroutine(HANDLE service_handle);
+/* 当前是否运行在协程模式服务的协程中 */
+bool service_can_await();
+/* 挂起当前协程直到session的应答(或超时)到达，不能等待时返回NULL */
+message *service_await_reply(int session);
 void service_handle_trash();
 void service_dispatch_message();
 #endif /* __QNODE_SERVICE_H__ */
@@ -26,6 +26,8 @@ static inline void spinlock_init(spinlock *lock) {
 	lock->lock = 0;
 }
 
+#ifdef USE_LEGACY_SPINLOCK
+/* 旧的实现，只用于对比测试 */
 static inline void spinlock_lock(spinlock *lock) {
 	while (ATOM_SET_OLD(&lock->lock,1)) {}
 }
@@ -38,6 +40,53 @@ static inline void spinlock_unlock(spinlock *lock) {
 	ATOM_RESET(&lock->lock);
 }
 
+#else
+
+#include <futex.h>
+
+/* *
+ * test-and-test-and-set，失败后指数退避，超过自旋次数后在futex上睡眠
+ * lock: 0 空闲，1 被持有，2 被持有且可能有线程睡眠
+ * */
+#define SPINLOCK_SPIN_LIMIT		16		/* 退避轮数 */
+#define SPINLOCK_BACKOFF_MAX	64		/* 单轮最多pause次数 */
+
+static inline void spinlock_lock_slow(spinlock *lock) {
+	int backoff = 1;
+	for(int spin=0; spin<SPINLOCK_SPIN_LIMIT; ++spin) {
+		/* 只读自旋，不占用cache line的独占权 */
+		if(0 == ATOM_LOAD(&lock->lock) && ATOM_CAS_BOOL(&lock->lock, 0, 1))
+			return;
+		for(int i=0; i<backoff; ++i) {
+			CPU_PAUSE();
+		}
+		backoff = MIN(backoff << 1, SPINLOCK_BACKOFF_MAX);
+	}
+
+	/* 置为2，释放者负责唤醒 */
+	while(0 != ATOM_XCHG(&lock->lock, 2)) {
+		futex_wait(&lock->lock, 2);
+	}
+}
+
+static inline void spinlock_lock(spinlock *lock) {
+	if(unlikely(!ATOM_CAS_BOOL(&lock->lock, 0, 1))) {
+		spinlock_lock_slow(lock);
+	}
+}
+
+static inline int spinlock_trylock(spinlock *lock) {
+	return 0 == ATOM_LOAD(&lock->lock) && ATOM_CAS_BOOL(&lock->lock, 0, 1);
+}
+
+static inline void spinlock_unlock(spinlock *lock) {
+	if(unlikely(2 == ATOM_XCHG(&lock->lock, 0))) {
+		futex_wake(&lock->lock, 1);
+	}
+}
+
+#endif /* USE_LEGACY_SPINLOCK */
+
 static inline void spinlock_destroy(spinlock *lock) {
 	IGNORE(lock);
 }
@@ -73,21 +73,46 @@ void thread_once(thread_once_t *guard, once_callback callback);
 thread *thread_self();
 
 typedef struct threadpool_limit{
-	int worker;
+	int worker;			/* 默认为在线cpu数减去I/O loop线程数 */
 	int service;
 	int task;
+	int loop;			/* I/O loop线程数 */
+	bool pin_worker;		/* worker按序绑定到loop之后的cpu */
+	bool pin_loop;		/* I/O loop线程独占最前面的cpu */
+	idle_strategy idle;	/* worker空闲时先自旋、让出cpu，最后睡眠 */
 } threadpool_limit;
 
 void threadpool_limit_init(threadpool_limit *limit);
 void threadpool_limit_worker(threadpool_limit *limit, int num);
 void threadpool_limit_service(threadpool_limit *limit, int num);
 void threadpool_limit_task(threadpool_limit *limit, int num);
+void threadpool_limit_loop(threadpool_limit *limit, int num);
+void threadpool_limit_affinity(threadpool_limit *limit, bool pin_worker, bool pin_loop);
+/* spin和yield都为0时worker空闲即睡眠 */
+void threadpool_limit_idle(threadpool_limit *limit, int spin, int yield);
+
+typedef struct threadpool_stat {
+	uint64_t parks;		/* worker睡眠次数 */
+	uint64_t wakes;		/* 提交任务时唤醒worker的系统调用次数 */
+	uint64_t steals;		/* 从其他worker窃取的任务数 */
+} threadpool_stat;
 
 typedef void *(*task_routine)(void *input, int *errcode);
 typedef void (*task_done)(void *result, int errcode);
 
-FORWARD_DECLAR(threadpool_task)
+typedef struct threadpool_task{
+	task_routine routine;
+	task_done done;
+	void *input;
+	void *result;
+	int errcode;
+	bool embedded;		/* 嵌入在其他结构中(如service)，worker不负责释放 */
+	queue_node node;
+} threadpool_task;
+
 threadpool_task *threadpool_task_create(task_routine routine, void *input, task_done done);
+/* 初始化嵌入式task，可以反复提交，但同一时刻只能在队列中出现一次 */
+void threadpool_task_init(threadpool_task *task, task_routine routine, void *input, task_done done);
 
 FORWARD_DECLAR(threadpool)
 int threadpool_init(threadpool_limit *limit);
@@ -98,6 +123,15 @@ int threadpool_boost_thread(thread_callback callback, void *arg, const char *tna
 int threadpool_apply_service(thread_callback callback, void *arg, const char *tname);
 thread *threadpool_handle_to_thread(int handle);
 int threadpool_submit(threadpool_task *task);
+/* 非阻塞提交，任务队列已满时返回ERROR_FAILD */
+int threadpool_try_submit(threadpool_task *task);
+/* I/O loop线程启动时调用，开启pin_loop时绑定到下一个预留的cpu，返回cpu编号，未绑定返回-1 */
+int threadpool_bind_loop();
+/* 打印线程与cpu的对应关系 */
+void threadpool_report();
+/* 全局队列或任一worker本地队列中是否还有等待执行的任务 */
+bool threadpool_has_pending();
+void threadpool_get_stat(threadpool_stat *stat);
 void threadpool_stop_thread(int handle);
 void threadpool_stop();
 #endif /* __QNODE_THREAD_H__ */
@@ -10,6 +10,7 @@
 #include <errcode.h>
 #include <spinlock.h>
 #include <queue.h>
+#include <timestamp.h>
 #include <stringpiece.h>
 #include <net.h>
 #include <message.h>
@@ -18,35 +19,101 @@
 
 extern int session_cache_init();
 extern int session_cache_release();
+extern void session_cache_start(net_eventloop *loop);
+
+/* *
+ * CoDel队列管理(服务端变体)
+ * 统计每个interval内消息停留时间的最小值，最小值都超过target说明积压不是瞬时突发，
+ * 之后的一个interval内停留时间超过2*target的消息直接丢弃，使排队延迟不超过2*target
+ * 生产者不会因为丢包而降速，所以不使用TCP中逐渐加快丢弃频率的控制律
+ * 除target/interval外的状态只由消费者修改；时间取微秒时钟的低32位，差值在71分钟内有效
+ * */
+typedef struct codel {
+	uint32_t target;				/* 微秒，0表示关闭 */
+	uint32_t interval;			/* 微秒 */
+	uint32_t interval_end;		/* 本统计区间的结束时刻，0表示尚未开始 */
+	uint32_t min_delay;			/* 本区间内的最小停留时间 */
+	bool overloaded;				/* 上一个区间的最小停留时间超过target */
+	uint64_t drops;				/* 丢弃总数 */
+} codel;
 
 typedef struct mailbox {
-	block_queue *msg_queue;				/* message queue */
-	uint64_t recv;
-	uint64_t consume;
+	mpsc_queue *msg_queue;				/* message queue : 多生产者单消费者 */
+	mpsc_queue *prio_queue;				/* 高优先级通道，attach到msg_queue上等待 */
+	int prio_streak;					/* 连续从高优先级通道取出的个数，只有消费者修改 */
+	uint64_t recv;						/* 投递总数，生产者原子递增 */
+	uint64_t consume;					/* 取出总数，只有消费者修改 */
+	atomic_t state;						/* mail_state */
+	codel codel;
 } mailbox;
 
+#define CODEL_TIME_AFTER_EQ(a, b)	((int32_t)((a) - (b)) >= 0)
+
+static inline uint32_t inner_codel_now() {
+	/* 0保留给未设置 */
+	return (uint32_t)timestamp_now().us | 1;
+}
+
+/* 消费者取出一封邮件后调用，返回true表示应该丢弃 */
+static bool inner_codel_should_drop(mailbox *box, const message *msg) {
+	codel *c = &box->codel;
+	uint32_t target = ATOM_LOAD(&c->target);
+	if(likely(0 == target || 0 == msg->enqueue)) {
+		if(unlikely(0 != c->interval_end)) {
+			c->interval_end = 0;
+			c->overloaded = false;
+		}
+		return false;
+	}
+
+	uint32_t now = inner_codel_now();
+	uint32_t delay = now - msg->enqueue;
+	if(0 == c->interval_end || CODEL_TIME_AFTER_EQ(now, c->interval_end)) {
+		/* 区间结束：用整个区间的最小停留时间判断是否过载 */
+		c->overloaded = 0 != c->interval_end && c->min_delay > target;
+		c->min_delay = delay;
+		c->interval_end = (now + ATOM_LOAD(&c->interval)) | 1;
+	} else if(delay < c->min_delay) {
+		c->min_delay = delay;
+	}
+
+	return c->overloaded && delay > 2 * target;
+}
+
 static void inner_destroy_message(queue_node *node) {
 	message *msg = DATA(node, message, node);
 	if(TEST_VAILD_PTR(msg)) {
-		FREE(msg->data);
-		FREE(msg);
+		message_free_data(msg);
+		message_free(msg);
 	}
 }
 
 mailbox *mailbox_create() {
 	MALLOC_DEF(box, mailbox);
 	if(TEST_VAILD_PTR(box)) {
-		box->msg_queue = block_queue_create();
-		if(TEST_VAILD_PTR(box->msg_queue)) {
+		box->msg_queue = mpsc_queue_create();
+		box->prio_queue = mpsc_queue_create();
+		if(TEST_VAILD_PTR(box->msg_queue) && TEST_VAILD_PTR(box->prio_queue)) {
+			mpsc_queue_attach(box->prio_queue, box->msg_queue);
+			box->prio_streak = 0;
 			box->consume = 0;
 			box->recv = 0;
+			atomic_set(&box->state, MAIL_IDLE);
+			STRUCT_ZERO(&box->codel);
 
 			return box;
-			block_queue_destroy(&box->msg_queue, inner_destroy_message);
 		}
+		/* 只创建成功一个通道时整个邮箱创建失败 */
+		if(TEST_VAILD_PTR(box->msg_queue)) {
+			mpsc_queue_destroy(&box->msg_queue, inner_destroy_message);
+		}
+		if(TEST_VAILD_PTR(box->prio_queue)) {
+			mpsc_queue_destroy(&box->prio_queue, inner_destroy_message);
+		}
+		FREE(box);
 	}
 
-	return box;
+	return NULL;
 }
 
 void mailbox_destroy(mailbox **box) {
@@ -54,7 +121,10 @@ void mailbox_destroy(mailbox **box) {
 		(*box)->consume = 0;
 		(*box)->recv = 0;
 		if(TEST_VAILD_PTR((*box)->msg_queue)) {
-			block_queue_destroy(&(*box)->msg_queue, inner_destroy_message);
+			mpsc_queue_destroy(&(*box)->msg_queue, inner_destroy_message);
+		}
+		if(TEST_VAILD_PTR((*box)->prio_queue)) {
+			mpsc_queue_destroy(&(*box)->prio_queue, inner_destroy_message);
 		}
 	}
 }
@@ -62,36 +132,187 @@ void mailbox_destroy(mailbox **box) {
 void mailbox_send(mailbox *box, message *msg) {
 	CHECK_VAILD_PTR(box);
 	CHECK_VAILD_PTR(msg);
-	block_queue_push(box->msg_queue, &msg->node);
+	ATOM_INC_NEW(&box->recv);
+	if(MSG_IS_PRI(msg)) {
+		/* 控制消息不参与CoDel */
+		msg->enqueue = 0;
+		mpsc_queue_push(box->prio_queue, &msg->node);
+	} else {
+		msg->enqueue = ATOM_LOAD(&box->codel.target) ? inner_codel_now() : 0;
+		mpsc_queue_push(box->msg_queue, &msg->node);
+	}
 }
 
-message *mailbox_recv(mailbox *box) {
+/* 按通道分成两条链，各自一次入队 */
+void mailbox_send_batch(mailbox *box, message *msgs[], int n) {
 	CHECK_VAILD_PTR(box);
-	message *msg = NULL;
+	CHECK_VAILD_PTR(msgs);
+	queue_node *first[2] = { NULL, NULL };
+	queue_node *last[2] = { NULL, NULL };
+	int count[2] = { 0, 0 };
+	uint32_t now = ATOM_LOAD(&box->codel.target) ? inner_codel_now() : 0;
+
+	ATOM_ADD_NEW(&box->recv, n);
+	for(int i=0; i<n; ++i) {
+		message *msg = msgs[i];
+		int lane = MSG_IS_PRI(msg) ? 1 : 0;
+		msg->enqueue = lane ? 0 : now;
+		queue_node *node = &msg->node;
+		if(TEST_VAILD_PTR(last[lane])) {
+			last[lane]->next = node;
+		} else {
+			first[lane] = node;
+		}
+		last[lane] = node;
+		++ count[lane];
+	}
+
+	if(count[1] > 0) {
+		mpsc_queue_push_batch(box->prio_queue, first[1], last[1], count[1]);
+	}
+	if(count[0] > 0) {
+		mpsc_queue_push_batch(box->msg_queue, first[0], last[0], count[0]);
+	}
+}
+
+static void inner_mailbox_discard(message *msg);
+
+/* *
+ * 优先取高优先级通道
+ * 普通通道有积压时，连续取出MAILBOX_PRIO_BURST封高优先级邮件后让出一次，避免普通通道饿死
+ * */
+static queue_node *inner_mailbox_pop_lane(mailbox *box) {
 	queue_node *node = NULL;
-	node = block_queue_pop(box->msg_queue);
-	if(TEST_VAILD_PTR(node)) {
-		msg = DATA(node, message, node);
+	if(box->prio_streak < MAILBOX_PRIO_BURST || mpsc_queue_empty(box->msg_queue)) {
+		node = mpsc_queue_try_pop(box->prio_queue);
+		if(TEST_VAILD_PTR(node)) {
+			++ box->prio_streak;
+			return node;
+		}
+	}
+
+	box->prio_streak = 0;
+	node = mpsc_queue_try_pop(box->msg_queue);
+	if(!TEST_VAILD_PTR(node)) {
+		node = mpsc_queue_try_pop(box->prio_queue);
 	}
 
-	return msg;
+	return node;
+}
+
+/* *
+ * 取出一封邮件，被CoDel丢弃的转入trash mailbox后继续取
+ * 丢弃过邮件之后不再阻塞等待：本次调度由被丢弃的邮件触发，队列已空时应该让出worker
+ * */
+static message *inner_mailbox_take(mailbox *box, bool block) {
+	mpsc_queue *lanes[] = { box->msg_queue, box->prio_queue };
+	bool dropped = false;
+	while(true) {
+		queue_node *node = inner_mailbox_pop_lane(box);
+		if(!TEST_VAILD_PTR(node)) {
+			/* 两个通道都为空时在msg_queue上等待 */
+			if(block && !dropped && mpsc_queue_wait_any(lanes, SIZE(lanes)))
+				continue;
+			return NULL;
+		}
+
+		message *msg = DATA(node, message, node);
+		ATOM_STORE_REL(&box->consume, box->consume + 1);
+		if(likely(!inner_codel_should_drop(box, msg)))
+			return msg;
+
+		ATOM_STORE_REL(&box->codel.drops, box->codel.drops + 1);
+		dropped = true;
+		inner_mailbox_discard(msg);
+	}
+}
+
+message *mailbox_recv(mailbox *box) {
+	CHECK_VAILD_PTR(box);
+	return inner_mailbox_take(box, true);
 }
 
 message *mailbox_try_recv(mailbox *box) {
 	CHECK_VAILD_PTR(box);
-	message *msg = NULL;
-	queue_node *node = NULL;
-	node = block_queue_try_pop(box->msg_queue);
-	if(TEST_VAILD_PTR(node)) {
-		msg = DATA(node, message, node);
+	return inner_mailbox_take(box, false);
+}
+
+int mailbox_try_recv_batch(mailbox *box, message *msgs[], int max) {
+	CHECK_VAILD_PTR(box);
+	int count = 0;
+	while(count < max) {
+		message *msg = inner_mailbox_take(box, false);
+		if(!TEST_VAILD_PTR(msg))
+			break;
+		msgs[count ++] = msg;
 	}
 
-	return msg;
+	return count;
 }
 
 bool mailbox_has_mail(mailbox *box) {
 	CHECK_VAILD_PTR(box);
-	return !block_queue_empty(box->msg_queue);
+	return !mpsc_queue_empty(box->msg_queue) || !mpsc_queue_empty(box->prio_queue);
+}
+
+/* 先计数后入队，得到的深度只会偏大 */
+size_t mailbox_depth(mailbox *box) {
+	CHECK_VAILD_PTR(box);
+	uint64_t consume = ATOM_LOAD_ACQ(&box->consume);
+	uint64_t recv = ATOM_LOAD_ACQ(&box->recv);
+	return recv > consume ? (size_t)(recv - consume) : 0;
+}
+
+/* *
+ * 就绪队列：保存有待处理消息的mailbox handle
+ * 每个handle同一时刻最多入队一次(由mailbox.state保证)，所以环形缓冲区不会溢出
+ * 主线程在eventcount上睡眠，只有它真正睡眠时生产者才进入内核唤醒
+ * */
+typedef struct ready_queue {
+	uint16_t handles[SERVICE_POOL_SIZE];
+	int head;
+	int size;
+	spinlock lock;
+	eventcount ec;
+	idle_strategy idle;
+} ready_queue;
+
+static void ready_queue_init(ready_queue *rq) {
+	rq->head = 0;
+	rq->size = 0;
+	SPIN_INIT(rq);
+	eventcount_init(&rq->ec);
+	/* 主线程没有别的事情可做，先让出几次cpu再睡眠 */
+	idle_strategy_init(&rq->idle, 0, IDLE_YIELD_DEFAULT);
+}
+
+static void ready_queue_destroy(ready_queue *rq) {
+	SPIN_DESTROY(rq);
+}
+
+static void ready_queue_push(ready_queue *rq, HANDLE handle) {
+	SPIN_LOCK(rq);
+	CHECK(rq->size < SERVICE_POOL_SIZE);
+	rq->handles[(rq->head + rq->size) % SERVICE_POOL_SIZE] = handle;
+	ATOM_STORE_REL(&rq->size, rq->size + 1);
+	SPIN_UNLOCK(rq);
+	(void)eventcount_notify(&rq->ec, 1);
+}
+
+static HANDLE ready_queue_try_pop(ready_queue *rq) {
+	HANDLE handle = INVAILD_SERVICE_HANDLE;
+	if(0 == ATOM_LOAD_ACQ(&rq->size))
+		return handle;
+
+	SPIN_LOCK(rq);
+	if(rq->size > 0) {
+		handle = rq->handles[rq->head];
+		rq->head = (rq->head + 1) % SERVICE_POOL_SIZE;
+		ATOM_STORE_REL(&rq->size, rq->size - 1);
+	}
+	SPIN_UNLOCK(rq);
+
+	return handle;
 }
 
 typedef struct context {
@@ -99,10 +320,19 @@ typedef struct context {
 	spinlock lock;
 	uint16_t id;			/* node id */
 	mailbox *slots[SERVICE_POOL_SIZE];
+	ready_queue ready;
 } context;
 
 static context *C = NULL;
 
+static void inner_mailbox_discard(message *msg) {
+	/* 被丢弃的请求立即以ERROR_FAILD应答，不设超时的调用方不会一直等待 */
+	if(MSG_IS_REQ(msg) && 0 != msg->session) {
+		(void)qreturn(SERVICE_ID(msg->source), ERROR_FAILD, NULL, 0, msg->session);
+	}
+	context_send_mail(INVAILD_SERVICE_HANDLE, msg);
+}
+
 context *global_context() {
 	return C;
 }
@@ -117,6 +347,7 @@ int context_init() {
 		NUL(c->loop);
 		SPIN_INIT(c);
 		ZERO(c->slots);
+		ready_queue_init(&c->ready);
 		C = c;
 		errcode = ERROR_SUCCESS;
 	}
@@ -135,6 +366,8 @@ int context_register_eventloop(net_eventloop *loop) {
 	SPIN_LOCK(C);
 	C->loop = loop;
 	SPIN_UNLOCK(C);
+	/* 会话超时由该loop扫描 */
+	session_cache_start(loop);
 
 	return ERROR_SUCCESS;
 }
@@ -169,7 +402,35 @@ void context_unregister_mailbox(HANDLE handle) {
 void context_send_mail(HANDLE handle, message *msg) {
 	CHECK_VAILD_PTR(C);
 	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
-	mailbox_send(C->slots[handle], msg);
+	mailbox *box = C->slots[handle];
+	mailbox_send(box, msg);
+	/* 只有从空闲变为就绪的那一次才入队 */
+	if(handle != INVAILD_SERVICE_HANDLE) {
+		if(atomic_cas(&box->state, MAIL_IDLE, MAIL_SCHEDULED)) {
+			ready_queue_push(&C->ready, handle);
+		}
+	} else {
+		/* trash mailbox不参与调度，只唤醒睡眠中的主线程去回收 */
+		(void)eventcount_notify(&C->ready.ec, 1);
+	}
+}
+
+void context_send_mails(HANDLE handle, message *msgs[], int n) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
+	if(n <= 0)
+		return;
+
+	mailbox *box = C->slots[handle];
+	mailbox_send_batch(box, msgs, n);
+	/* 整批最多触发一次调度 */
+	if(handle != INVAILD_SERVICE_HANDLE) {
+		if(atomic_cas(&box->state, MAIL_IDLE, MAIL_SCHEDULED)) {
+			ready_queue_push(&C->ready, handle);
+		}
+	} else {
+		(void)eventcount_notify(&C->ready.ec, 1);
+	}
 }
 
 message *context_recv_mail(HANDLE handle) {
@@ -184,12 +445,147 @@ message *context_try_recv_mail(HANDLE handle) {
 	return mailbox_try_recv(C->slots[handle]);
 }
 
+int context_try_recv_mails(HANDLE handle, message *msgs[], int max) {
+	CHECK_VAILD_PTR(C);
+	CHECK_VAILD_PTR(msgs);
+	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
+	return mailbox_try_recv_batch(C->slots[handle], msgs, max);
+}
+
 bool context_has_mail(HANDLE handle) {
 	CHECK_VAILD_PTR(C);
 	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
 	return mailbox_has_mail(C->slots[handle]);
 }
 
+size_t context_get_mail_depth(HANDLE handle) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	return TEST_VAILD_PTR(box) ? mailbox_depth(box) : 0;
+}
+
+void context_set_mailbox_idle(HANDLE handle, int spin, int yield) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	CHECK_VAILD_PTR(box);
+	mpsc_queue_set_idle(box->msg_queue, spin, yield);
+}
+
+void context_get_mailbox_idle_stat(HANDLE handle, uint64_t *parks, uint64_t *wakes) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	CHECK_VAILD_PTR(box);
+	mpsc_queue_get_idle_stat(box->msg_queue, parks, wakes);
+}
+
+/* 有就绪的handle或者trash中有待回收的邮件 */
+static inline bool inner_ready_pending() {
+	mailbox *trash = C->slots[INVAILD_SERVICE_HANDLE];
+	return ATOM_LOAD_ACQ(&C->ready.size) > 0 ||
+			(TEST_VAILD_PTR(trash) && mailbox_has_mail(trash));
+}
+
+void context_set_mailbox_codel(HANDLE handle, double target_s, double interval_s) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle < INVAILD_SERVICE_HANDLE);
+	CHECK(target_s >= 0 && interval_s >= 0);
+	mailbox *box = C->slots[handle];
+	CHECK_VAILD_PTR(box);
+	uint32_t target = (uint32_t)(target_s * MICRO_SECOND_PER_SECOND);
+	uint32_t interval = (uint32_t)(interval_s * MICRO_SECOND_PER_SECOND);
+	/* 先设置interval，消费者看到target非0时interval已经有效 */
+	ATOM_STORE_REL(&box->codel.interval, MAX(interval, 1));
+	ATOM_STORE_REL(&box->codel.target, target);
+}
+
+void context_get_mailbox_codel(HANDLE handle, double *target_s, double *interval_s, uint64_t *drops) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle < INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	CHECK_VAILD_PTR(box);
+	if(TEST_VAILD_PTR(target_s)) {
+		*target_s = (double)ATOM_LOAD_ACQ(&box->codel.target) / MICRO_SECOND_PER_SECOND;
+	}
+	if(TEST_VAILD_PTR(interval_s)) {
+		*interval_s = (double)ATOM_LOAD_ACQ(&box->codel.interval) / MICRO_SECOND_PER_SECOND;
+	}
+	if(TEST_VAILD_PTR(drops)) {
+		*drops = ATOM_LOAD_ACQ(&box->codel.drops);
+	}
+}
+
+HANDLE context_wait_ready(double timeout_s) {
+	CHECK_VAILD_PTR(C);
+	ready_queue *rq = &C->ready;
+	HANDLE handle = ready_queue_try_pop(rq);
+	if(TEST_VAILD_SERVICE_HANDLE(handle) || 0 == timeout_s)
+		return handle;
+
+	for(int round = 0; !inner_ready_pending(); ++ round) {
+		if(!idle_strategy_backoff(&rq->idle, round)) {
+			int key = eventcount_prepare(&rq->ec);
+			if(inner_ready_pending()) {
+				eventcount_cancel(&rq->ec);
+			} else {
+				eventcount_wait(&rq->ec, key, timeout_s);
+			}
+			break;
+		}
+	}
+
+	return ready_queue_try_pop(rq);
+}
+
+void context_get_ready_idle_stat(uint64_t *parks, uint64_t *wakes) {
+	CHECK_VAILD_PTR(C);
+	CHECK_VAILD_PTR(parks);
+	CHECK_VAILD_PTR(wakes);
+	*parks = ATOM_LOAD(&C->ready.ec.parks);
+	*wakes = ATOM_LOAD(&C->ready.ec.wakes);
+}
+
+void context_post_ready(HANDLE handle) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle < INVAILD_SERVICE_HANDLE);
+	ready_queue_push(&C->ready, handle);
+}
+
+void context_reset_ready(HANDLE handle) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle <= INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	if(TEST_VAILD_PTR(box)) {
+		atomic_set(&box->state, MAIL_IDLE);
+	}
+}
+
+void context_run_ready(HANDLE handle) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle < INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	if(TEST_VAILD_PTR(box)) {
+		CHECK(atomic_get(&box->state) == MAIL_SCHEDULED);
+		atomic_set(&box->state, MAIL_RUNNING);
+	}
+}
+
+bool context_finish_ready(HANDLE handle) {
+	CHECK_VAILD_PTR(C);
+	CHECK(handle >=0 && handle < INVAILD_SERVICE_HANDLE);
+	mailbox *box = C->slots[handle];
+	if(!TEST_VAILD_PTR(box))
+		return false;
+
+	atomic_set(&box->state, MAIL_IDLE);
+	FULL_BARRIER();
+	/* 执行期间到达的消息不会入队，需要重新检查 */
+	return mailbox_has_mail(box) &&
+			atomic_cas(&box->state, MAIL_IDLE, MAIL_SCHEDULED);
+}
+
 net_eventloop *context_select_eventloop() {
 	CHECK_VAILD_PTR(C);
 
@@ -209,6 +605,7 @@ void context_release() {
 		}
 		SPIN_UNLOCK(C);
 
+		ready_queue_destroy(&C->ready);
 		FREE(C);
 	}
 }
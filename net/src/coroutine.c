@@ -0,0 +1,192 @@
+/*
+ * coroutine.c
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <define.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <coroutine.h>
+
+typedef struct coroutine {
+	ucontext_t ctx;
+	ucontext_t caller;			/* resume时保存调用者的上下文 */
+	coroutine_fn fn;
+	void *args;
+	coroutine_state state;
+	coroutine *prev;				/* resume之前当前线程正在运行的协程 */
+	void *stack;					/* 包括保护页 */
+	size_t stack_size;
+	struct coroutine *next;		/* 缓存链表 */
+} coroutine;
+
+typedef struct coroutine_pool {
+	coroutine *free;
+	int cached;
+	int active;
+	uint64_t created;
+	uint64_t reused;
+	uint64_t switches;
+	spinlock lock;
+} coroutine_pool;
+
+static coroutine_pool g_coPool;		/* 零初始化 */
+__thread static coroutine *t_currentCoroutine = NULL;
+
+static coroutine *inner_coroutine_alloc() {
+	MALLOC_DEF(co, coroutine);
+	if(!TEST_VAILD_PTR(co))
+		return NULL;
+
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	co->stack_size = COROUTINE_STACK_SIZE + page;
+	co->stack = mmap(NULL, co->stack_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(MAP_FAILED == co->stack) {
+		FREE(co);
+		return NULL;
+	}
+	/* 栈向低地址增长，最低的一页作为保护页 */
+	(void)mprotect(co->stack, page, PROT_NONE);
+
+	return co;
+}
+
+static void inner_coroutine_free(coroutine *co) {
+	munmap(co->stack, co->stack_size);
+	FREE(co);
+}
+
+/* makecontext只能传递int参数，指针拆成两半 */
+static void inner_coroutine_entry(uint32_t hi, uint32_t lo) {
+	coroutine *co = (coroutine *)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+	co->fn(co->args);
+	co->state = COROUTINE_DEAD;
+	/* 不会再返回 */
+	setcontext(&co->caller);
+}
+
+coroutine *coroutine_create(coroutine_fn fn, void *args) {
+	CHECK_VAILD_PTR(fn);
+	SPIN_LOCK(&g_coPool);
+	coroutine *co = g_coPool.free;
+	if(TEST_VAILD_PTR(co)) {
+		g_coPool.free = co->next;
+		-- g_coPool.cached;
+		++ g_coPool.reused;
+	}
+	++ g_coPool.active;
+	SPIN_UNLOCK(&g_coPool);
+
+	if(!TEST_VAILD_PTR(co)) {
+		co = inner_coroutine_alloc();
+		if(!TEST_VAILD_PTR(co)) {
+			SPIN_LOCK(&g_coPool);
+			-- g_coPool.active;
+			SPIN_UNLOCK(&g_coPool);
+			return NULL;
+		}
+		ATOM_INC_NEW(&g_coPool.created);
+	}
+
+	size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	co->fn = fn;
+	co->args = args;
+	co->state = COROUTINE_READY;
+	NUL(co->prev);
+	NUL(co->next);
+	getcontext(&co->ctx);
+	co->ctx.uc_stack.ss_sp = (char *)co->stack + page;
+	co->ctx.uc_stack.ss_size = co->stack_size - page;
+	NUL(co->ctx.uc_link);
+	uintptr_t ptr = (uintptr_t)co;
+	makecontext(&co->ctx, (void (*)())inner_coroutine_entry, 2,
+			(uint32_t)(ptr >> 32), (uint32_t)ptr);
+
+	return co;
+}
+
+void coroutine_destroy(coroutine *co) {
+	if(!TEST_VAILD_PTR(co))
+		return;
+	/* 挂起的协程也可以销毁，栈上的状态直接丢弃 */
+	CHECK(COROUTINE_RUNNING != co->state);
+
+	bool cache = false;
+	SPIN_LOCK(&g_coPool);
+	-- g_coPool.active;
+	if(g_coPool.cached < COROUTINE_POOL_MAX) {
+		co->next = g_coPool.free;
+		g_coPool.free = co;
+		++ g_coPool.cached;
+		cache = true;
+	}
+	SPIN_UNLOCK(&g_coPool);
+
+	if(!cache) {
+		inner_coroutine_free(co);
+	}
+}
+
+coroutine_state coroutine_resume(coroutine *co) {
+	CHECK_VAILD_PTR(co);
+	CHECK(COROUTINE_READY == co->state || COROUTINE_SUSPENDED == co->state);
+	co->prev = t_currentCoroutine;
+	co->state = COROUTINE_RUNNING;
+	t_currentCoroutine = co;
+	ATOM_INC_NEW(&g_coPool.switches);
+	swapcontext(&co->caller, &co->ctx);
+	/* 协程挂起或结束之后回到这里，线程仍然是调用resume的线程 */
+	t_currentCoroutine = co->prev;
+	NUL(co->prev);
+
+	return co->state;
+}
+
+void coroutine_yield() {
+	coroutine *co = t_currentCoroutine;
+	CHECK_VAILD_PTR(co);
+	co->state = COROUTINE_SUSPENDED;
+	ATOM_INC_NEW(&g_coPool.switches);
+	swapcontext(&co->ctx, &co->caller);
+	/* 可能已经在另一个线程中被恢复 */
+}
+
+coroutine *coroutine_current() {
+	return t_currentCoroutine;
+}
+
+coroutine_state coroutine_get_state(coroutine *co) {
+	CHECK_VAILD_PTR(co);
+	return co->state;
+}
+
+void coroutine_pool_get_stat(coroutine_pool_stat *stat) {
+	CHECK_VAILD_PTR(stat);
+	SPIN_LOCK(&g_coPool);
+	stat->created = g_coPool.created;
+	stat->reused = g_coPool.reused;
+	stat->switches = g_coPool.switches;
+	stat->active = g_coPool.active;
+	stat->cached = g_coPool.cached;
+	SPIN_UNLOCK(&g_coPool);
+}
+
+void coroutine_pool_release() {
+	SPIN_LOCK(&g_coPool);
+	coroutine *list = g_coPool.free;
+	NUL(g_coPool.free);
+	g_coPool.cached = 0;
+	SPIN_UNLOCK(&g_coPool);
+
+	while(TEST_VAILD_PTR(list)) {
+		coroutine *co = list;
+		list = co->next;
+		inner_coroutine_free(co);
+	}
+}
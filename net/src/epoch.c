@@ -0,0 +1,192 @@
+/*
+ * epoch.c
+ *
+ *  Created on: 2026年10月17日
+ *      Author: linzer
+ */
+#include <define.h>
+#include <atomic.h>
+#include <spinlock.h>
+#include <epoch.h>
+#include <sched.h>
+
+/* *
+ * 每个线程一条记录，epoch为0表示不在临界区，否则为进入时的全局epoch
+ * 只有所有活跃读者都已经观察到当前epoch，全局epoch才能前进
+ * 在epoch E登记的对象，等全局epoch到达E+2时一定没有读者再持有
+ * 记录不回收，随进程结束释放
+ * */
+typedef struct epoch_record {
+	volatile uint64_t epoch;
+	int nest;
+	struct epoch_record *next;
+} epoch_record;
+
+typedef struct epoch_node {
+	void *ptr;
+	epoch_free_fn free_fn;
+	uint64_t epoch;
+	struct epoch_node *next;
+} epoch_node;
+
+typedef struct epoch_domain {
+	volatile uint64_t epoch;
+	epoch_record *records;		/* 只增不减，读者无锁遍历 */
+	int threads;
+	epoch_node *limbo;			/* 等待释放的对象，新登记的在前 */
+	uint64_t retired;
+	uint64_t reclaimed;
+	spinlock lock;
+} epoch_domain;
+
+static epoch_domain g_epoch = { .epoch = 1 };
+__thread static epoch_record *t_epochRecord = NULL;
+
+static epoch_record *inner_epoch_record() {
+	if(unlikely(!TEST_VAILD_PTR(t_epochRecord))) {
+		MALLOC_DEF(rec, epoch_record);
+		CHECK_VAILD_PTR(rec);
+		STRUCT_ZERO(rec);
+		SPIN_LOCK(&g_epoch);
+		rec->next = g_epoch.records;
+		ATOM_STORE_REL(&g_epoch.records, rec);
+		++ g_epoch.threads;
+		SPIN_UNLOCK(&g_epoch);
+		t_epochRecord = rec;
+	}
+
+	return t_epochRecord;
+}
+
+void epoch_enter() {
+	epoch_record *rec = inner_epoch_record();
+	if(0 == rec->nest ++) {
+		uint64_t epoch;
+		/* 发布之后全局epoch没有变化，读到的指针才受保护 */
+		do {
+			epoch = ATOM_LOAD_ACQ(&g_epoch.epoch);
+			rec->epoch = epoch;
+			FULL_BARRIER();
+		} while(epoch != ATOM_LOAD_ACQ(&g_epoch.epoch));
+	}
+}
+
+void epoch_leave() {
+	epoch_record *rec = t_epochRecord;
+	CHECK(TEST_VAILD_PTR(rec) && rec->nest > 0);
+	if(0 == -- rec->nest) {
+		ATOM_STORE_REL(&rec->epoch, 0);
+	}
+}
+
+/* 调用者持有锁 */
+static bool inner_epoch_try_advance() {
+	uint64_t epoch = g_epoch.epoch;
+	for(epoch_record *rec = ATOM_LOAD_ACQ(&g_epoch.records); TEST_VAILD_PTR(rec); rec = rec->next) {
+		uint64_t e = ATOM_LOAD_ACQ(&rec->epoch);
+		if(0 != e && e != epoch)
+			return false;
+	}
+
+	return ATOM_CAS_BOOL(&g_epoch.epoch, epoch, epoch + 1);
+}
+
+void epoch_retire(void *ptr, epoch_free_fn free_fn) {
+	if(!TEST_VAILD_PTR(ptr))
+		return;
+	CHECK_VAILD_PTR(free_fn);
+	MALLOC_DEF(node, epoch_node);
+	if(!TEST_VAILD_PTR(node)) {
+		/* 没有内存登记时只能等待所有读者离开 */
+		SPIN_LOCK(&g_epoch);
+		uint64_t target = g_epoch.epoch + 2;
+		while(g_epoch.epoch < target) {
+			if(!inner_epoch_try_advance()) {
+				SPIN_UNLOCK(&g_epoch);
+				sched_yield();
+				SPIN_LOCK(&g_epoch);
+			}
+		}
+		SPIN_UNLOCK(&g_epoch);
+		free_fn(ptr);
+		return;
+	}
+
+	node->ptr = ptr;
+	node->free_fn = free_fn;
+	/* 撤下指针之后再读取epoch */
+	FULL_BARRIER();
+	SPIN_LOCK(&g_epoch);
+	node->epoch = g_epoch.epoch;
+	node->next = g_epoch.limbo;
+	g_epoch.limbo = node;
+	++ g_epoch.retired;
+	SPIN_UNLOCK(&g_epoch);
+
+	(void)epoch_reclaim();
+}
+
+int epoch_reclaim() {
+	epoch_node *list = NULL;
+	int count = 0;
+
+	SPIN_LOCK(&g_epoch);
+	if(TEST_VAILD_PTR(g_epoch.limbo)) {
+		/* 最多推进两次，新登记的对象也有机会在本次释放 */
+		if(inner_epoch_try_advance()) {
+			(void)inner_epoch_try_advance();
+		}
+
+		epoch_node **pptr = &g_epoch.limbo;
+		while(TEST_VAILD_PTR(*pptr)) {
+			epoch_node *node = *pptr;
+			if(node->epoch + 2 <= g_epoch.epoch) {
+				*pptr = node->next;
+				node->next = list;
+				list = node;
+				++ count;
+			} else {
+				pptr = &node->next;
+			}
+		}
+		g_epoch.reclaimed += count;
+	}
+	SPIN_UNLOCK(&g_epoch);
+
+	/* 在锁外释放，free_fn中可以再次登记 */
+	while(TEST_VAILD_PTR(list)) {
+		epoch_node *node = list;
+		list = node->next;
+		node->free_fn(node->ptr);
+		FREE(node);
+	}
+
+	return count;
+}
+
+void epoch_release() {
+	SPIN_LOCK(&g_epoch);
+	epoch_node *list = g_epoch.limbo;
+	NUL(g_epoch.limbo);
+	SPIN_UNLOCK(&g_epoch);
+
+	while(TEST_VAILD_PTR(list)) {
+		epoch_node *node = list;
+		list = node->next;
+		node->free_fn(node->ptr);
+		FREE(node);
+		SPIN_LOCK(&g_epoch);
+		++ g_epoch.reclaimed;
+		SPIN_UNLOCK(&g_epoch);
+	}
+}
+
+void epoch_get_stat(epoch_stat *stat) {
+	CHECK_VAILD_PTR(stat);
+	SPIN_LOCK(&g_epoch);
+	stat->epoch = g_epoch.epoch;
+	stat->retired = g_epoch.retired;
+	stat->reclaimed = g_epoch.reclaimed;
+	stat->threads = g_epoch.threads;
+	SPIN_UNLOCK(&g_epoch);
+}
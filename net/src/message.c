@@ -8,32 +8,427 @@
 #include <errcode.h>
 #include <atomic.h>
 #include <queue.h>
-#include <tire.h>
+#include <array.h>
 #include <spinlock.h>
+#include <timestamp.h>
+#include <epoch.h>
+#include <thread.h>
+#include <net_eventloop.h>
 #include <service.h>
 #include <context.h>
 #include <message.h>
 
-static uint64_t g_genSessionID = 0;
+/* *
+ * 会话表
+ * session = 代数(10位) | 分片(4位) | 槽位(18位)，O(1)插入和删除，代数不为0所以session不为0
+ * 每个分片独立加锁，调用线程固定使用一个分片，槽位按段分配，只增不减，内存只取决于并发调用的峰值
+ * 空闲槽位先进先出，槽位的重用间隔尽量长，迟到的应答不会命中新的调用
+ * 截止时间挂在分片的时间轮上，由loop线程的周期定时器统一扫描
+ * */
+#define SESSION_SLOT_BITS	18
+#define SESSION_SHARD_BITS	4
+#define SESSION_GEN_BITS		10
+#define SESSION_SHARDS		(1 << SESSION_SHARD_BITS)
+#define SESSION_SLOT_MASK	((1u << SESSION_SLOT_BITS) - 1)
+#define SESSION_SHARD_MASK	(SESSION_SHARDS - 1)
+#define SESSION_GEN_MASK		((1u << SESSION_GEN_BITS) - 1)
+#define SESSION_SEG_SIZE		1024
+#define SESSION_SEGMENTS		((1 << SESSION_SLOT_BITS) / SESSION_SEG_SIZE)
+#define SESSION_WHEEL_SIZE	512		/* 2的幂 */
+#define SESSION_TICK			0.01		/* 时间轮精度(秒) */
+#define SESSION_NIL			(-1)
 
-typedef struct session_cache {
-	idtree tree;
+typedef struct session_entry {
+	uint32_t gen;				/* 当前代数，槽位空闲时不匹配任何session */
+	bool used;
+	int prev;					/* 时间轮链表，空闲时next为空闲链表 */
+	int next;
+	uint64_t deadline;			/* 截止tick，0表示不超时 */
+	HANDLE caller;
+	HANDLE peer;
+	call_success_cb scb;
+	call_faild_cb fcb;
+	struct call_group *group;	/* qcall_many的成员调用，应答交给调用组 */
+	int member;
+} session_entry;
+
+typedef struct session_shard {
 	spinlock lock;
+	int size;					/* 已分配的槽位数 */
+	int live;
+	int free_head;
+	int free_tail;
+	uint64_t swept;				/* 已扫描到的tick */
+	int wheel[SESSION_WHEEL_SIZE];
+	session_entry *segs[SESSION_SEGMENTS];
+} __attribute__((aligned(64))) session_shard;
+
+typedef struct session_cache {
+	int64_t base;				/* tick的起点(微秒) */
+	uint64_t calls;
+	uint64_t timeouts;
+	uint64_t lates;
+	int shard_seq;
+	bool sweeping;
+	session_shard shards[SESSION_SHARDS];
 } session_cache;
 
-typedef struct session_cb {
-	call_success_cb scb;
-	call_faild_cb fcb;
-} session_cb;
+/* 调用超时后派发的结果 */
+typedef struct session_expired {
+	int session;
+	session_entry entry;
+} session_expired;
+
+/* *
+ * 调用组，一次分配，成员调用只占用会话槽位和消息
+ * pending初始多算一次，全部成员发出之后再减去，成员应答不会提前完成调用组
+ * */
+typedef struct call_group {
+	int pending;
+	call_many_cb cb;
+	call_many_result result;
+} call_group;
 
 static session_cache *SC = NULL;
+extern __thread HANDLE t_selfHandle;
+__thread static int t_sessionShard = SESSION_NIL;
+
+/* *
+ * 线程消息池
+ * 每个线程从自己的空闲链表分配消息，按slab批量向系统申请
+ * 其他线程释放的消息通过无锁栈归还给所属线程，所属线程在空闲链表耗尽时一次性取回
+ * 线程退出时消息池连同空闲链表和无锁栈挂到全局孤儿链表，之后新建的线程优先领养，
+ * 仍在流转的消息照常归还到原消息池
+ * slab不会被释放，消息池随进程结束而回收
+ * */
+#define MESSAGE_SLAB_SIZE	64
+#define MSG_POOL_NEXT(msg)	(*(message **)&(msg)->node.next)
+
+typedef struct message_pool {
+	message *free;			/* 本线程空闲链表 */
+	message *remote;			/* 其他线程归还的消息 */
+	uint64_t alloc;
+	uint64_t hit;
+	uint64_t slab;
+	uint64_t local_free;
+	uint64_t remote_free;
+	struct message_pool *next;
+	struct message_pool *orphan_next;
+} message_pool;
+
+typedef struct message_pools {
+	message_pool *head;
+	message_pool *orphans;	/* 所属线程已退出，等待领养 */
+	int count;
+	int orphan_count;
+	spinlock lock;
+} message_pools;
+
+static message_pools g_msgPools;		/* 零初始化 */
+static pthread_key_t g_msgPoolKey;
+static thread_once_t g_msgPoolOnce = THREAD_ONCE_INIT;
+__thread static message_pool *t_msgPool = NULL;
+
+/* 线程退出时调用 */
+static void inner_message_pool_orphan(void *ptr) {
+	message_pool *pool = (message_pool *)ptr;
+	/* 此后本线程释放的消息也走无锁栈 */
+	NUL(t_msgPool);
+	SPIN_LOCK(&g_msgPools);
+	pool->orphan_next = g_msgPools.orphans;
+	g_msgPools.orphans = pool;
+	++ g_msgPools.orphan_count;
+	SPIN_UNLOCK(&g_msgPools);
+}
+
+static void inner_message_pool_key_init() {
+	if(0 != pthread_key_create(&g_msgPoolKey, inner_message_pool_orphan))
+		abort();
+}
+
+static message_pool *inner_message_pool() {
+	if(unlikely(!TEST_VAILD_PTR(t_msgPool))) {
+		thread_once(&g_msgPoolOnce, inner_message_pool_key_init);
+		SPIN_LOCK(&g_msgPools);
+		message_pool *pool = g_msgPools.orphans;
+		if(TEST_VAILD_PTR(pool)) {
+			/* 领养退出线程的消息池，它的空闲链表和无锁栈一并接手 */
+			g_msgPools.orphans = pool->orphan_next;
+			-- g_msgPools.orphan_count;
+			NUL(pool->orphan_next);
+		}
+		SPIN_UNLOCK(&g_msgPools);
+
+		if(!TEST_VAILD_PTR(pool)) {
+			MALLOC(pool, message_pool);
+			CHECK_VAILD_PTR(pool);
+			STRUCT_ZERO(pool);
+			SPIN_LOCK(&g_msgPools);
+			pool->next = g_msgPools.head;
+			g_msgPools.head = pool;
+			++ g_msgPools.count;
+			SPIN_UNLOCK(&g_msgPools);
+		}
+		/* 只有设置了非空值的线程退出时才会调用析构函数 */
+		(void)pthread_setspecific(g_msgPoolKey, pool);
+		t_msgPool = pool;
+	}
+
+	return t_msgPool;
+}
+
+static bool inner_message_pool_refill(message_pool *pool) {
+	/* 先取回其他线程归还的消息 */
+	pool->free = ATOM_XCHG(&pool->remote, NULL);
+	if(TEST_VAILD_PTR(pool->free))
+		return true;
+
+	/* 按cache line对齐，保证消息头和内联payload各占一行 */
+	message *slab = NULL;
+	if(0 != posix_memalign((void **)&slab, __alignof__(message), sizeof(message) * MESSAGE_SLAB_SIZE))
+		return false;
+
+	for(int i=0; i<MESSAGE_SLAB_SIZE; ++i) {
+		MSG_POOL_NEXT(&slab[i]) = i + 1 < MESSAGE_SLAB_SIZE ? &slab[i + 1] : NULL;
+	}
+	pool->free = slab;
+	++ pool->slab;
+
+	return true;
+}
+
+message *message_alloc() {
+	message_pool *pool = inner_message_pool();
+	message *msg = NULL;
+	++ pool->alloc;
+	if(TEST_VAILD_PTR(pool->free)) {
+		++ pool->hit;
+	} else if(!inner_message_pool_refill(pool)) {
+		return NULL;
+	}
+
+	msg = pool->free;
+	pool->free = MSG_POOL_NEXT(msg);
+	/* 内联payload不需要清零 */
+	memset(msg, 0, OFFSETOF(message, payload));
+	msg->pool = pool;
+
+	return msg;
+}
+
+message *message_alloc_payload(size_t size) {
+	message *msg = message_alloc();
+	if(TEST_VAILD_PTR(msg)) {
+		if(size <= MSG_INLINE_SIZE) {
+			msg->data = msg->payload;
+			msg->type |= MSG_INL;
+		} else {
+			MALLOC_SIZE(msg->data, size);
+			if(!TEST_VAILD_PTR(msg->data)) {
+				message_free(msg);
+				return NULL;
+			}
+		}
+		msg->size = size;
+	}
+
+	return msg;
+}
+
+void message_free_data(message *msg) {
+	CHECK_VAILD_PTR(msg);
+	if(MSG_IS_SHA(msg)) {
+		/* 只释放本消息持有的引用 */
+		if(TEST_VAILD_PTR(msg->data)) {
+			payload_release(payload_of(msg->data));
+		}
+		NUL(msg->data);
+	} else if(!MSG_IS_INL(msg)) {
+		FREE(msg->data);
+	} else {
+		NUL(msg->data);
+	}
+}
+
+shared_payload *payload_create(const void *data, size_t size) {
+	/* size为0且data不为NULL的消息表示buffer指针，共享payload不能为空 */
+	if(0 == size)
+		return NULL;
+
+	shared_payload *payload = (shared_payload *)malloc(sizeof(shared_payload) + size);
+	if(TEST_VAILD_PTR(payload)) {
+		payload->magic = SHARED_PAYLOAD_MAGIC;
+		payload->refs = 1;
+		payload->size = size;
+		if(TEST_VAILD_PTR(data)) {
+			memcpy(payload->data, data, size);
+		}
+	}
+
+	return payload;
+}
+
+shared_payload *payload_retain(shared_payload *payload) {
+	CHECK_VAILD_PTR(payload);
+	ATOM_INC_NEW(&payload->refs);
+	return payload;
+}
+
+void payload_release(shared_payload *payload) {
+	if(!TEST_VAILD_PTR(payload))
+		return;
+
+	int refs = ATOM_DEC_NEW(&payload->refs);
+	CHECK(refs >= 0);
+	/* 原子减是完整屏障，最后一个引用释放时其他接收者的读取都已结束 */
+	if(0 == refs) {
+		payload->magic = 0;
+		FREE(payload);
+	}
+}
+
+shared_payload *payload_of(const void *data) {
+	CHECK_VAILD_PTR(data);
+	shared_payload *payload = DATA(data, shared_payload, data);
+	CHECK(SHARED_PAYLOAD_MAGIC == payload->magic);
+	return payload;
+}
+
+void message_free(message *msg) {
+	if(!TEST_VAILD_PTR(msg))
+		return;
+
+	message_pool *pool = (message_pool *)msg->pool;
+	CHECK_VAILD_PTR(pool);
+	if(pool == t_msgPool) {
+		MSG_POOL_NEXT(msg) = pool->free;
+		pool->free = msg;
+		++ pool->local_free;
+	} else {
+		/* 归还给所属线程：只有push和整体取走，不存在ABA问题 */
+		message *head = NULL;
+		do {
+			head = ATOM_LOAD_ACQ(&pool->remote);
+			MSG_POOL_NEXT(msg) = head;
+		} while(!ATOM_CAS_BOOL(&pool->remote, head, msg));
+		ATOM_INC_NEW(&pool->remote_free);
+	}
+}
+
+void message_pool_get_stat(message_pool_stat *stat) {
+	CHECK_VAILD_PTR(stat);
+	STRUCT_ZERO(stat);
+	SPIN_LOCK(&g_msgPools);
+	for(message_pool *pool = g_msgPools.head; TEST_VAILD_PTR(pool); pool = pool->next) {
+		stat->alloc += pool->alloc;
+		stat->hit += pool->hit;
+		stat->slab += pool->slab;
+		stat->local_free += pool->local_free;
+		stat->remote_free += pool->remote_free;
+	}
+	stat->pools = g_msgPools.count;
+	stat->orphans = g_msgPools.orphan_count;
+	SPIN_UNLOCK(&g_msgPools);
+}
+
+double message_pool_hit_rate() {
+	message_pool_stat stat;
+	message_pool_get_stat(&stat);
+	return stat.alloc ? (double)stat.hit / stat.alloc : 0;
+}
+
+static inline uint64_t inner_session_tick(session_cache *sc) {
+	return (uint64_t)(timestamp_now().us - sc->base) / (uint64_t)(SESSION_TICK * MICRO_SECOND_PER_SECOND);
+}
+
+static inline session_entry *inner_session_entry(session_shard *shard, int slot) {
+	return &shard->segs[slot / SESSION_SEG_SIZE][slot % SESSION_SEG_SIZE];
+}
+
+static inline int inner_session_make(uint32_t gen, int shard, int slot) {
+	return (int)(gen << (SESSION_SHARD_BITS + SESSION_SLOT_BITS) |
+			(uint32_t)shard << SESSION_SLOT_BITS | (uint32_t)slot);
+}
+
+/* 调用者持有分片锁 */
+static void inner_session_wheel_link(session_shard *shard, int slot) {
+	session_entry *e = inner_session_entry(shard, slot);
+	int *head = &shard->wheel[e->deadline & (SESSION_WHEEL_SIZE - 1)];
+	e->prev = SESSION_NIL;
+	e->next = *head;
+	if(SESSION_NIL != *head) {
+		inner_session_entry(shard, *head)->prev = slot;
+	}
+	*head = slot;
+}
+
+/* 调用者持有分片锁 */
+static void inner_session_wheel_unlink(session_shard *shard, int slot) {
+	session_entry *e = inner_session_entry(shard, slot);
+	if(SESSION_NIL != e->prev) {
+		inner_session_entry(shard, e->prev)->next = e->next;
+	} else {
+		shard->wheel[e->deadline & (SESSION_WHEEL_SIZE - 1)] = e->next;
+	}
+	if(SESSION_NIL != e->next) {
+		inner_session_entry(shard, e->next)->prev = e->prev;
+	}
+}
+
+/* 调用者持有分片锁，槽位放回空闲链表尾部 */
+static void inner_session_release_slot(session_shard *shard, int slot) {
+	session_entry *e = inner_session_entry(shard, slot);
+	e->used = false;
+	e->gen = (e->gen & SESSION_GEN_MASK) + 1;
+	if(e->gen > SESSION_GEN_MASK) {
+		e->gen = 1;
+	}
+	e->next = SESSION_NIL;
+	if(SESSION_NIL != shard->free_tail) {
+		inner_session_entry(shard, shard->free_tail)->next = slot;
+	} else {
+		shard->free_head = slot;
+	}
+	shard->free_tail = slot;
+	-- shard->live;
+}
+
+/* 调用者持有分片锁 */
+static bool inner_session_grow(session_shard *shard) {
+	if(shard->size >= SESSION_SEGMENTS * SESSION_SEG_SIZE)
+		return false;
+
+	session_entry *seg = (session_entry *)malloc(sizeof(session_entry) * SESSION_SEG_SIZE);
+	if(!TEST_VAILD_PTR(seg))
+		return false;
+
+	shard->segs[shard->size / SESSION_SEG_SIZE] = seg;
+	for(int i=0; i<SESSION_SEG_SIZE; ++i) {
+		seg[i].gen = SESSION_GEN_MASK;
+		++ shard->live;
+		/* 借用释放逻辑串入空闲链表，代数从1开始 */
+		inner_session_release_slot(shard, shard->size + i);
+	}
+	shard->size += SESSION_SEG_SIZE;
+
+	return true;
+}
 
 int session_cache_init() {
 	int errcode = ERROR_FAILD;
 	MALLOC_DEF(sc, session_cache);
 	if(TEST_VAILD_PTR(sc)) {
-		SPIN_INIT(sc);
-		idtree_init(&sc->tree);
+		STRUCT_ZERO(sc);
+		sc->base = timestamp_now().us;
+		for(int i=0; i<SESSION_SHARDS; ++i) {
+			session_shard *shard = &sc->shards[i];
+			SPIN_INIT(shard);
+			shard->free_head = SESSION_NIL;
+			shard->free_tail = SESSION_NIL;
+			for(int j=0; j<SESSION_WHEEL_SIZE; ++j) {
+				shard->wheel[j] = SESSION_NIL;
+			}
+		}
 		SC = sc;
 		errcode = ERROR_SUCCESS;
 	}
@@ -41,35 +436,222 @@ int session_cache_init() {
 	return errcode;
 }
 
+static void inner_session_cache_free(void *ptr) {
+	session_cache *sc = (session_cache *)ptr;
+	for(int i=0; i<SESSION_SHARDS; ++i) {
+		session_shard *shard = &sc->shards[i];
+		for(int j=0; j<shard->size / SESSION_SEG_SIZE; ++j) {
+			FREE(shard->segs[j]);
+		}
+		SPIN_DESTROY(shard);
+	}
+	FREE(sc);
+}
+
 void session_cache_release() {
 	CHECK_VAILD_PTR(SC);
-	SPIN_LOCK(SC);
-	idtree_release(&SC->tree);
-	SPIN_UNLOCK(SC);
-	SPIN_DESTROY(SC);
-	FREE(SC);
+	session_cache *sc = SC;
+	/* 定时器无法取消，扫描函数可能正在使用sc，撤下后延迟释放 */
+	ATOM_STORE_REL(&SC, NULL);
+	epoch_retire(sc, inner_session_cache_free);
 }
 
-static void session_cache_insert(uint64_t session, session_cb *cb) {
-	CHECK_VAILD_PTR(cb);
+/* timeout <= 0 不超时，失败返回0 */
+static int session_cache_insert(HANDLE peer, double timeout,
+		call_success_cb scb, call_faild_cb fcb, call_group *group, int member) {
 	CHECK_VAILD_PTR(SC);
-	SPIN_LOCK(SC);
-	idtree_insert(&SC->tree, session, cb);
-	SPIN_UNLOCK(SC);
+	if(unlikely(SESSION_NIL == t_sessionShard)) {
+		t_sessionShard = ATOM_INC_OLD(&SC->shard_seq) & SESSION_SHARD_MASK;
+	}
+	session_shard *shard = &SC->shards[t_sessionShard];
+	uint64_t ticks = timeout > 0 ? (uint64_t)(timeout / SESSION_TICK) + 1 : 0;
+
+	int session = 0;
+	SPIN_LOCK(shard);
+	/* 锁内计算，避免落到扫描函数已经走过的tick上 */
+	uint64_t deadline = ticks ? MAX(inner_session_tick(SC) + ticks, shard->swept + 1) : 0;
+	if(SESSION_NIL != shard->free_head || inner_session_grow(shard)) {
+		int slot = shard->free_head;
+		session_entry *e = inner_session_entry(shard, slot);
+		shard->free_head = e->next;
+		if(SESSION_NIL == shard->free_head) {
+			shard->free_tail = SESSION_NIL;
+		}
+		e->used = true;
+		e->deadline = deadline;
+		e->caller = t_selfHandle;
+		e->peer = peer;
+		e->scb = scb;
+		e->fcb = fcb;
+		e->group = group;
+		e->member = member;
+		if(deadline) {
+			inner_session_wheel_link(shard, slot);
+		}
+		++ shard->live;
+		session = inner_session_make(e->gen, t_sessionShard, slot);
+	}
+	SPIN_UNLOCK(shard);
+
+	if(session) {
+		ATOM_INC_NEW(&SC->calls);
+	}
+	return session;
 }
 
-static session_cb *session_cache_remove(uint64_t session) {
+/* 会话已经超时或不存在时返回false */
+static bool session_cache_remove(int session, session_entry *out) {
 	CHECK_VAILD_PTR(SC);
-	SPIN_LOCK(SC);
-	session_cb *cb = idtree_remove(&SC->tree, session);
-	SPIN_UNLOCK(SC);
+	uint32_t id = (uint32_t)session;
+	uint32_t gen = id >> (SESSION_SHARD_BITS + SESSION_SLOT_BITS);
+	session_shard *shard = &SC->shards[(id >> SESSION_SLOT_BITS) & SESSION_SHARD_MASK];
+	int slot = (int)(id & SESSION_SLOT_MASK);
+
+	bool found = false;
+	SPIN_LOCK(shard);
+	if(slot < shard->size) {
+		session_entry *e = inner_session_entry(shard, slot);
+		if(e->used && e->gen == gen) {
+			*out = *e;
+			if(e->deadline) {
+				inner_session_wheel_unlink(shard, slot);
+			}
+			inner_session_release_slot(shard, slot);
+			found = true;
+		}
+	}
+	SPIN_UNLOCK(shard);
 
-	return cb;
+	return found;
+}
+
+/* 调用者持有分片锁，摘下bucket中到期的会话 */
+static int inner_session_expire_bucket(session_shard *shard, int shard_id, int index,
+		uint64_t now, ARRAY *expired) {
+	int count = 0;
+	int slot = shard->wheel[index];
+	while(SESSION_NIL != slot) {
+		session_entry *e = inner_session_entry(shard, slot);
+		int next = e->next;
+		if(e->deadline <= now) {
+			session_expired item;
+			item.session = inner_session_make(e->gen, shard_id, slot);
+			item.entry = *e;
+			if(!TEST_VAILD_PTR(*expired)) {
+				ARRAY_NEW(*expired);
+			}
+			ARRAY_PUSH_BACK(*expired, session_expired, item);
+			inner_session_wheel_unlink(shard, slot);
+			inner_session_release_slot(shard, slot);
+			++ count;
+		}
+		slot = next;
+	}
+
+	return count;
+}
+
+/* 成员应答到达或超时(msg为NULL)，最后一个成员完成调用组 */
+static void inner_call_group_arrive(call_group *group, int member, message *msg) {
+	if(TEST_VAILD_PTR(msg)) {
+		group->result.replies[member] = msg;
+		ATOM_INC_NEW(&group->result.arrived);
+	}
+	if(0 == ATOM_DEC_NEW(&group->pending)) {
+		call_many_result *result = &group->result;
+		result->errcode = result->arrived == result->size ? ERROR_SUCCESS : ERROR_TIMEOUT;
+		group->cb(result);
+		FREE(group);
+	}
+}
+
+/* 超时按失败应答处理，与qreturn一样先回调再投递给调用者 */
+static void inner_session_timeout(session_expired *item) {
+	if(TEST_VAILD_PTR(item->entry.group)) {
+		/* 调用组只记录缺失的成员，不生成超时消息 */
+		inner_call_group_arrive(item->entry.group, item->entry.member, NULL);
+		return;
+	}
+
+	message *msg = quick_gen_msg(item->entry.peer, item->session, NULL, 0, MSG_RAW | MSG_PRI);
+	if(TEST_VAILD_PTR(msg)) {
+		msg->errcode = ERROR_TIMEOUT;
+		if(TEST_VAILD_PTR(item->entry.fcb)) {
+			item->entry.fcb(msg);
+		}
+		service_push_message(item->entry.caller, msg);
+	}
+}
+
+/* loop线程的周期定时器 */
+static void inner_session_sweep(void *args) {
+	IGNORE(args);
+	/* 与session_cache_release并发时，epoch保证sc在本次扫描期间有效 */
+	epoch_enter();
+	session_cache *sc = ATOM_LOAD_ACQ(&SC);
+	if(!TEST_VAILD_PTR(sc)) {
+		epoch_leave();
+		return;
+	}
+
+	/* 大多数tick没有超时，按需创建 */
+	ARRAY expired = NULL;
+	uint64_t now = inner_session_tick(sc);
+	for(int i=0; i<SESSION_SHARDS; ++i) {
+		session_shard *shard = &sc->shards[i];
+		SPIN_LOCK(shard);
+		/* 落后超过一圈时每个bucket只需扫描一次 */
+		uint64_t from = shard->swept + 1;
+		if(now >= from + SESSION_WHEEL_SIZE) {
+			from = now - SESSION_WHEEL_SIZE + 1;
+		}
+		for(uint64_t tick = from; tick <= now; ++tick) {
+			inner_session_expire_bucket(shard, i, tick & (SESSION_WHEEL_SIZE - 1), now, &expired);
+		}
+		shard->swept = MAX(shard->swept, now);
+		SPIN_UNLOCK(shard);
+	}
+
+	if(TEST_VAILD_PTR(expired)) {
+		/* 回调在锁外执行 */
+		ARRAY_FOREACH(item, expired, session_expired) {
+			inner_session_timeout(item);
+		}
+		ATOM_ADD_NEW(&sc->timeouts, ARRAY_SIZE(expired, session_expired));
+		ARRAY_DESTROY(expired);
+	}
+	epoch_leave();
+}
+
+void session_cache_start(net_eventloop *loop) {
+	CHECK_VAILD_PTR(SC);
+	CHECK_VAILD_PTR(loop);
+	if(ATOM_CAS_BOOL(&SC->sweeping, false, true)) {
+		pending_entry entry;
+		entry.callback = inner_session_sweep;
+		entry.args = NULL;
+		eventloop_settimer_every(loop, SESSION_TICK, entry);
+	}
+}
+
+void session_get_stat(session_stat *stat) {
+	CHECK_VAILD_PTR(SC);
+	CHECK_VAILD_PTR(stat);
+	STRUCT_ZERO(stat);
+	stat->calls = ATOM_LOAD(&SC->calls);
+	stat->timeouts = ATOM_LOAD(&SC->timeouts);
+	stat->lates = ATOM_LOAD(&SC->lates);
+	for(int i=0; i<SESSION_SHARDS; ++i) {
+		session_shard *shard = &SC->shards[i];
+		SPIN_LOCK(shard);
+		stat->live += shard->live;
+		stat->capacity += shard->size;
+		SPIN_UNLOCK(shard);
+	}
 }
 
 message *quick_gen_msg(HANDLE self, int session, void *data, size_t size, int type) {
-	MALLOC_DEF(msg, message);
-	STRUCT_ZERO(msg);
+	message *msg = message_alloc();
 	if(TEST_VAILD_PTR(msg)) {
 		msg->type = type;
 		msg->source = service_get_harborid(self);
@@ -81,12 +663,22 @@ message *quick_gen_msg(HANDLE self, int session, void *data, size_t size, int ty
 	return msg;
 }
 
-extern __thread HANDLE t_selfHandle;
+message *quick_gen_msg_copy(HANDLE self, int session, const void *data, size_t size, int type) {
+	message *msg = message_alloc_payload(size);
+	if(TEST_VAILD_PTR(msg)) {
+		msg->type |= type;
+		msg->source = service_get_harborid(self);
+		msg->session = session;
+		if(size > 0) {
+			memcpy(msg->data, data, size);
+		}
+	}
 
-int qsend(const char*sname, void *data, size_t size, bool share) {
-	int type = MSG_RAW;
-	type |= share ? MSG_SHA : MSG_CPY ;
-	HANDLE peer = service_get_handle(sname);
+	return msg;
+}
+
+
+static int inner_qsend(HANDLE peer, void *data, size_t size, int type) {
 	message *msg = quick_gen_msg(t_selfHandle, 0, data, size, type);
 	int errcode = ERROR_FAILD;
 	if(TEST_VAILD_PTR(msg)) {
@@ -97,53 +689,340 @@ int qsend(const char*sname, void *data, size_t size, bool share) {
 	return errcode;
 }
 
-int qcall(const char*sname, void *data, size_t size,
+int qsend_batch(HANDLE peer, message *msgs[], int n) {
+	CHECK_VAILD_PTR(msgs);
+	if(n <= 0)
+		return ERROR_SUCCESS;
+
+	service_push_messages(peer, msgs, n);
+	return ERROR_SUCCESS;
+}
+
+/* *
+ * loop线程的发送缓冲
+ * qsend_buffered暂存消息，在本轮事件循环结束时按目标合并，每个目标一次qsend_batch
+ * 同一目标的消息保持发送顺序，缓冲满时提前提交
+ * */
+#define SEND_BUFFER_SIZE	256
+#define SEND_BUFFER_FLUSHED	(-1)		/* 已经提交的槽位 */
+
+typedef struct send_buffer {
+	int count;
+	bool hooked;					/* 是否已经注册到本线程的loop */
+	HANDLE peers[SEND_BUFFER_SIZE];
+	message *msgs[SEND_BUFFER_SIZE];
+} send_buffer;
+
+__thread static send_buffer t_sendBuffer;
+
+void qsend_flush() {
+	send_buffer *sb = &t_sendBuffer;
+	message *batch[SEND_BUFFER_SIZE];
+	for(int i=0; i<sb->count; ++i) {
+		HANDLE peer = sb->peers[i];
+		if(SEND_BUFFER_FLUSHED == peer)
+			continue;
+
+		int n = 0;
+		for(int j=i; j<sb->count; ++j) {
+			if(sb->peers[j] == peer) {
+				batch[n ++] = sb->msgs[j];
+				sb->peers[j] = SEND_BUFFER_FLUSHED;
+			}
+		}
+		qsend_batch(peer, batch, n);
+	}
+	sb->count = 0;
+}
+
+static void inner_send_buffer_flush(void *args) {
+	IGNORE(args);
+	qsend_flush();
+}
+
+int qsend_buffered_msg(HANDLE peer, message *msg) {
+	CHECK_VAILD_PTR(msg);
+	net_eventloop *loop = eventloop_currentthread();
+	/* 不在loop线程中没有提交的时机，直接按单条批量投递，同样检查高水位 */
+	if(!TEST_VAILD_PTR(loop))
+		return qsend_batch(peer, &msg, 1);
+
+	send_buffer *sb = &t_sendBuffer;
+	if(unlikely(!sb->hooked)) {
+		pending_entry entry;
+		entry.callback = inner_send_buffer_flush;
+		entry.args = NULL;
+		eventloop_add_flush(loop, entry);
+		sb->hooked = true;
+	}
+
+	if(SEND_BUFFER_SIZE == sb->count) {
+		qsend_flush();
+	}
+	sb->peers[sb->count] = peer;
+	sb->msgs[sb->count] = msg;
+	++ sb->count;
+
+	return ERROR_SUCCESS;
+}
+
+int qsend_buffered(HANDLE peer, void *data, size_t size, bool share) {
+	message *msg = quick_gen_msg(t_selfHandle, 0, data, size, MSG_RAW | (share ? MSG_SHA : MSG_CPY));
+	if(!TEST_VAILD_PTR(msg))
+		return ERROR_FAILD;
+
+	return qsend_buffered_msg(peer, msg);
+}
+
+int qmulticast(const HANDLE peers[], int n, shared_payload *payload) {
+	CHECK_VAILD_PTR(peers);
+	CHECK_VAILD_PTR(payload);
+	if(n <= 0)
+		return 0;
+
+	/* 先一次取得全部引用，接收者可能在发送过程中就已经释放 */
+	ATOM_ADD_NEW(&payload->refs, n);
+	int used = 0;
+	int sent = 0;
+	for(int i=0; i<n; ++i) {
+		if(!TEST_VAILD_SERVICE_HANDLE(peers[i]))
+			continue;
+		message *msg = quick_gen_msg(t_selfHandle, 0, payload->data, payload->size, MSG_RAW | MSG_SHA);
+		if(!TEST_VAILD_PTR(msg))
+			continue;
+		/* 未注册的接收者由trash回收消息，引用随之释放，不计入投递数 */
+		++ used;
+		if(service_push_message(peers[i], msg)) {
+			++ sent;
+		}
+	}
+	/* 归还没有用掉的引用 */
+	for(int i=used; i<n; ++i) {
+		payload_release(payload);
+	}
+
+	return sent;
+}
+
+#define BROADCAST_CHUNK	256
+
+int qbroadcast(shared_payload *payload) {
+	CHECK_VAILD_PTR(payload);
+	/* *
+	 * 分段取得服务列表，不需要为整张服务表分配内存
+	 * 只发给servlet：TYPE_SERVICE(gate、log、console等)不会按消息处理广播数据
+	 * */
+	HANDLE peers[BROADCAST_CHUNK];
+	int sent = 0;
+	HANDLE from = 0;
+	int count = 0;
+	while((count = service_list(from, TYPE_SERVLET, peers, SIZE(peers))) > 0) {
+		from = peers[count - 1] + 1;
+		int n = 0;
+		for(int i=0; i<count; ++i) {
+			if(peers[i] != t_selfHandle) {
+				peers[n ++] = peers[i];
+			}
+		}
+		sent += qmulticast(peers, n, payload);
+	}
+
+	return sent;
+}
+
+int qsend_handle(HANDLE peer, void *data, size_t size, bool share) {
+	return inner_qsend(peer, data, size, MSG_RAW | (share ? MSG_SHA : MSG_CPY));
+}
+
+int qsend_handle_prio(HANDLE peer, void *data, size_t size, bool share) {
+	return inner_qsend(peer, data, size, MSG_RAW | MSG_PRI | (share ? MSG_SHA : MSG_CPY));
+}
+
+/* 按名字发送时，分片服务轮询选择实例 */
+static inline HANDLE inner_route_name(const char *sname) {
+	return service_route(service_get_handle(sname), SERVICE_ROUTE_RR);
+}
+
+int qsend_prio(const char*sname, void *data, size_t size, bool share) {
+	return qsend_handle_prio(inner_route_name(sname), data, size, share);
+}
+
+int qsend(const char*sname, void *data, size_t size, bool share) {
+	return qsend_handle(inner_route_name(sname), data, size, share);
+}
+
+int qsend_key(const char*sname, uint64_t key, void *data, size_t size, bool share) {
+	return qsend_handle(service_route(service_get_handle(sname), key), data, size, share);
+}
+
+int qsend_copy(const char*sname, const void *data, size_t size) {
+	HANDLE peer = inner_route_name(sname);
+	message *msg = quick_gen_msg_copy(t_selfHandle, 0, data, size, MSG_RAW | MSG_CPY);
+	int errcode = ERROR_FAILD;
+	if(TEST_VAILD_PTR(msg)) {
+		service_push_message(peer, msg);
+		errcode = ERROR_SUCCESS;
+	}
+
+	return errcode;
+}
+
+int qcall_handle_timeout(HANDLE peer, void *data, size_t size, double timeout,
 		call_success_cb scb, call_faild_cb fcb) {
 	int errcode = ERROR_FAILD;
 	int type = MSG_REQ | MSG_CPY;
-	HANDLE peer = service_get_handle(sname);
-	int session = ATOM_INC_NEW(&g_genSessionID);
-	while(!session) {
-		session = ATOM_INC_NEW(&g_genSessionID);
-	}
-	CHECK(session != 0);
-	message *msg = quick_gen_msg(t_selfHandle, session, data, size, type);
+	message *msg = quick_gen_msg(t_selfHandle, 0, data, size, type);
 
 	if(TEST_VAILD_PTR(msg)) {
-		MALLOC_DEF(cb, session_cb);
-		if(TEST_VAILD_PTR(cb)) {
-			cb->scb = scb;
-			cb->fcb = fcb;
-			session_cache_insert(session, cb);
+		int session = session_cache_insert(peer, timeout, scb, fcb, NULL, 0);
+		if(session) {
+			msg->session = session;
 			service_push_message(peer, msg);
 			errcode = ERROR_SUCCESS;
+		} else {
+			/* 没有发出，data仍归调用者 */
+			message_free(msg);
 		}
-
-		FREE(msg);
 	}
 
 	return errcode;
 }
 
+int qcall_handle(HANDLE peer, void *data, size_t size,
+		call_success_cb scb, call_faild_cb fcb) {
+	return qcall_handle_timeout(peer, data, size, DEFAULT_CALL_TIMEOUT, scb, fcb);
+}
+
+message *qcall_handle_await(HANDLE peer, void *data, size_t size, double timeout) {
+	/* 先确认可以挂起，避免登记永远没有人等待的会话 */
+	if(!service_can_await())
+		return NULL;
+
+	message *msg = quick_gen_msg(t_selfHandle, 0, data, size, MSG_REQ | MSG_CPY);
+	if(!TEST_VAILD_PTR(msg))
+		return NULL;
+
+	/* 对方已经退出时不会有应答，挂起的协程必须有截止时间 */
+	if(timeout <= 0) {
+		timeout = DEFAULT_CALL_TIMEOUT;
+	}
+	/* 应答由服务的取消息函数截获，不需要回调 */
+	int session = session_cache_insert(peer, timeout, NULL, NULL, NULL, 0);
+	if(!session) {
+		/* 只释放消息，data仍归调用者 */
+		message_free(msg);
+		return NULL;
+	}
+	msg->session = session;
+	service_push_message(peer, msg);
+
+	return service_await_reply(session);
+}
+
+message *qcall_await(const char*sname, void *data, size_t size, double timeout) {
+	return qcall_handle_await(inner_route_name(sname), data, size, timeout);
+}
+
+int qcall_many_handle(const HANDLE peers[], void *datas[], const size_t sizes[], int n,
+		double timeout, call_many_cb cb, void *ud) {
+	CHECK_VAILD_PTR(peers);
+	CHECK_VAILD_PTR(cb);
+	CHECK(n > 0);
+	call_group *group = (call_group *)malloc(sizeof(call_group) + sizeof(message *) * n);
+	if(!TEST_VAILD_PTR(group))
+		return ERROR_FAILD;
+
+	group->pending = n + 1;
+	group->cb = cb;
+	group->result.size = n;
+	group->result.arrived = 0;
+	group->result.errcode = ERROR_SUCCESS;
+	group->result.ud = ud;
+	group->result.replies = (message **)(group + 1);
+	memset(group->result.replies, 0, sizeof(message *) * n);
+
+	for(int i=0; i<n; ++i) {
+		void *data = TEST_VAILD_PTR(datas) ? datas[i] : NULL;
+		size_t size = TEST_VAILD_PTR(sizes) ? sizes[i] : 0;
+		message *msg = NULL;
+		int session = 0;
+		if(TEST_VAILD_SERVICE_HANDLE(peers[i])) {
+			msg = quick_gen_msg(t_selfHandle, 0, data, size, MSG_REQ | MSG_CPY);
+		}
+		if(TEST_VAILD_PTR(msg)) {
+			session = session_cache_insert(peers[i], timeout, NULL, NULL, group, i);
+		}
+		if(session) {
+			msg->session = session;
+			service_push_message(peers[i], msg);
+		} else {
+			/* 发送失败的成员立即按缺失处理 */
+			if(TEST_VAILD_PTR(msg)) {
+				message_free(msg);
+			}
+			inner_call_group_arrive(group, i, NULL);
+		}
+	}
+	/* 去掉初始多算的一次，所有成员都已经完成时在这里回调 */
+	inner_call_group_arrive(group, 0, NULL);
+
+	return ERROR_SUCCESS;
+}
+
+int qcall_many(const char *snames[], void *datas[], const size_t sizes[], int n,
+		double timeout, call_many_cb cb, void *ud) {
+	CHECK_VAILD_PTR(snames);
+	CHECK(n > 0);
+	HANDLE peers[n];
+	for(int i=0; i<n; ++i) {
+		peers[i] = inner_route_name(snames[i]);
+	}
+
+	return qcall_many_handle(peers, datas, sizes, n, timeout, cb, ud);
+}
+
+int qcall_timeout(const char*sname, void *data, size_t size, double timeout,
+		call_success_cb scb, call_faild_cb fcb) {
+	return qcall_handle_timeout(inner_route_name(sname), data, size, timeout, scb, fcb);
+}
+
+int qcall(const char*sname, void *data, size_t size,
+		call_success_cb scb, call_faild_cb fcb) {
+	return qcall_handle(inner_route_name(sname), data, size, scb, fcb);
+}
+
 int qreturn(HANDLE peer, int err,
 		void *data, size_t size, int session) {
-	int type = MSG_RAW | MSG_CPY;
+	/* 应答通常会解除对方的等待，走高优先级通道 */
+	int type = MSG_RAW | MSG_CPY | MSG_PRI;
 	int errcode = ERROR_FAILD;
 	CHECK(session != 0);
 	message *msg = quick_gen_msg(t_selfHandle, session, data, size, type);
 
 	if(TEST_VAILD_PTR(msg)) {
 		msg->errcode = err;
-		session_cb *cb = session_cache_remove(session);
-		CHECK_VAILD_PTR(cb);
-		if(TEST_SUCCESS(err)) {
-			cb->scb(msg);
+		session_entry cb;
+		if(!session_cache_remove(session, &cb)) {
+			/* 调用方已经按超时处理，丢弃迟到的应答，data已经交给应答消息 */
+			ATOM_INC_NEW(&SC->lates);
+			message_free_data(msg);
+			message_free(msg);
+			errcode = ERROR_TIMEOUT;
+		} else if(TEST_VAILD_PTR(cb.group)) {
+			/* 成员应答归调用组所有，不再单独投递 */
+			inner_call_group_arrive(cb.group, cb.member, msg);
+			errcode = ERROR_SUCCESS;
 		} else {
-			cb->fcb(msg);
+			if(TEST_SUCCESS(err)) {
+				if(TEST_VAILD_PTR(cb.scb)) {
+					cb.scb(msg);
+				}
+			} else if(TEST_VAILD_PTR(cb.fcb)) {
+				cb.fcb(msg);
+			}
+			service_push_message(peer, msg);
+			errcode = ERROR_SUCCESS;
 		}
-		FREE(cb);
-		service_push_message(peer, msg);
-		errcode = ERROR_SUCCESS;
 	}
 
 	return errcode;
@@ -487,6 +487,9 @@ static inline void inner_imple_startread(void *args) {
 	net_connection *conn = (net_connection *)args;
 	CHECK_VAILD_PTR(conn);
 	eventloop_check_inloopthread(conn->loop);
+	/* 投递之后连接可能已经关闭，channel已从poller中移除 */
+	if(!connection_test_connected(conn))
+		return;
 	if(!ATOMIC_TEST(conn->reading) || !channel_can_read(conn->channel)) {
 		channel_enable_read(conn->channel);
 		ATOMIC_TRUE(conn->reading);
@@ -506,6 +509,9 @@ static inline void inner_imple_stopread(void *args) {
 	net_connection *conn = (net_connection *)args;
 	CHECK_VAILD_PTR(conn);
 	eventloop_check_inloopthread(conn->loop);
+	/* 投递之后连接可能已经关闭，channel已从poller中移除 */
+	if(!connection_test_connected(conn))
+		return;
 	if(ATOMIC_TEST(conn->reading) || channel_can_read(conn->channel)) {
 		channel_disable_read(conn->channel);
 		ATOMIC_FALSE(conn->reading);
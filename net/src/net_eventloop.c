@@ -37,6 +37,7 @@ typedef struct net_eventloop {
 	ARRAY activeChannels;			/* net_channel * */
 	net_channel *currentChannel;
 	ARRAY pendingFuncs;				/* pending_entry */
+	ARRAY flushFuncs;				/* pending_entry，每轮循环结束时调用，只在loop线程中访问 */
 	int owner;
 	mutex lock;
 } net_eventloop;
@@ -53,9 +54,24 @@ static inline void wakeup_read_handle(void *data, timestamp ts) {
 	}
 }
 
+/* loop交给调用线程运行，线程局部的当前loop随之转移 */
 void eventloop_asgin_owner(net_eventloop *loop) {
 	CHECK_VAILD_PTR(loop);
 	loop->owner = thread_current_id();
+	t_loopInThisThread = loop;
+}
+
+/* *
+ * 创建loop的线程不负责运行时调用，解除owner和t_loopInThisThread
+ * 之后其他线程的pending函数都排队，直到运行线程调用eventloop_asgin_owner
+ * */
+void eventloop_release_owner(net_eventloop *loop) {
+	CHECK_VAILD_PTR(loop);
+	eventloop_check_inloopthread(loop);
+	loop->owner = 0;
+	if(t_loopInThisThread == loop) {
+		NUL(t_loopInThisThread);
+	}
 }
 
 net_eventloop *eventloop_create() {
@@ -75,7 +91,8 @@ net_eventloop *eventloop_create() {
 		loop->iteration = 0;
 		NUL(loop->currentChannel);
 		loop->pollReturn = timestamp_invaild();
-		eventloop_asgin_owner(loop);
+		/* 创建成功之后才绑定t_loopInThisThread */
+		loop->owner = thread_current_id();
 		MUTEX_INIT(loop);
 		int ret = INVAILD_FD;
 #ifdef __linux__
@@ -95,7 +112,8 @@ net_eventloop *eventloop_create() {
 						ARRAY_NEW(loop->activeChannels);
 						if(TEST_VAILD_PTR(loop->activeChannels)) {
 							ARRAY_NEW(loop->pendingFuncs);
-							if(TEST_VAILD_PTR(loop->pendingFuncs)) {
+							ARRAY_NEW(loop->flushFuncs);
+							if(TEST_VAILD_PTR(loop->pendingFuncs) && TEST_VAILD_PTR(loop->flushFuncs)) {
 								t_loopInThisThread = loop;
 								channel_event_entry entry;
 								entry.callback = wakeup_read_handle;
@@ -105,6 +123,12 @@ net_eventloop *eventloop_create() {
 								return loop;
 							}
 
+							if(TEST_VAILD_PTR(loop->pendingFuncs)) {
+								ARRAY_DESTROY(loop->pendingFuncs);
+							}
+							if(TEST_VAILD_PTR(loop->flushFuncs)) {
+								ARRAY_DESTROY(loop->flushFuncs);
+							}
 							ARRAY_DESTROY(loop->activeChannels);
 						}
 
@@ -146,6 +170,7 @@ void eventloop_destroy(net_eventloop **loop) {
 		timermanager_destroy(&(*loop)->timermgr);
 		ARRAY_DESTROY((*loop)->activeChannels);
 		ARRAY_DESTROY((*loop)->pendingFuncs);
+		ARRAY_DESTROY((*loop)->flushFuncs);
 		MUTEX_DESTROY(*loop);
 		FREE(*loop);
 	}
@@ -316,6 +341,13 @@ void eventloop_do_pendingfunc(net_eventloop *loop) {
 	ATOMIC_FALSE(loop->calling);
 }
 
+void eventloop_add_flush(net_eventloop *loop, pending_entry entry) {
+	CHECK_VAILD_PTR(loop);
+	CHECK_VAILD_PTR(entry.callback);
+	eventloop_check_inloopthread(loop);
+	ARRAY_PUSH_BACK(loop->flushFuncs, pending_entry, entry);
+}
+
 static const int DEFAULT_POLL_TIMEOUT_MS = -1;
 static const int MAX_SAFE_POLL_TIMEOUT_MS = 1789569;
 
@@ -332,6 +364,10 @@ void inner_run_loop(net_eventloop *loop, int timeout) {
 	NUL(loop->currentChannel);
 	atomic_set(&loop->handling, false);
 	eventloop_do_pendingfunc(loop);
+	/* 本轮产生的缓冲数据(如批量发送的消息)统一提交 */
+	ARRAY_FOREACH(entry, loop->flushFuncs, pending_entry) {
+		entry->callback(entry->args);
+	}
 }
 
 void eventloop_run_loop(net_eventloop *loop) {
@@ -5,6 +5,8 @@
  *      Author: linzer
  */
 
+#include <sched.h>
+
 #include <queue.h>
 
 /* 私有宏. */
@@ -289,6 +291,216 @@ void block_queue_destroy(block_queue **q, queue_node_free_cb free_cb) {
 	}
 }
 
+/* mpsc queue */
+#define MPSC_NEXT(node)		(*(queue_node **)&(node)->next)
+
+static inline void inner_mpsc_link(mpsc_queue *q, queue_node *node) {
+	ATOM_STORE_REL(&MPSC_NEXT(node), NULL);
+	queue_node *prev = ATOM_XCHG(&q->head, node);
+	/* 在这之前消费者看不到node，try_pop可能短暂返回NULL */
+	ATOM_STORE_REL(&MPSC_NEXT(prev), node);
+}
+
+mpsc_queue *mpsc_queue_create() {
+	mpsc_queue *q = (mpsc_queue *)malloc(sizeof(mpsc_queue));
+	assert(NULL != q);
+	MPSC_NEXT(&q->stub) = NULL;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+	atomic_set(&q->size, 0);
+	eventcount_init(&q->ec);
+	/* 默认立即睡眠，需要低延迟的邮箱通过mpsc_queue_set_idle开启自旋 */
+	idle_strategy_init(&q->idle, 0, 0);
+	q->finish = false;
+	q->owner = q;
+	return q;
+}
+
+int mpsc_queue_empty(const mpsc_queue *q) {
+	assert(q != NULL);
+	return atomic_get(&q->size) == 0;
+}
+
+int mpsc_queue_size(const mpsc_queue *q) {
+	assert(q != NULL);
+	return atomic_get(&q->size);
+}
+
+bool mpsc_queue_push(mpsc_queue *q, queue_node *node) {
+	assert(q != NULL);
+	assert(node != NULL);
+	if(q->finish)
+		return false;
+
+	/* 先计数后链接：size>0而try_pop为NULL表示生产者正在入队 */
+	atomic_inc(&q->size);
+	inner_mpsc_link(q, node);
+	(void)eventcount_notify(&q->owner->ec, 1);
+
+	return true;
+}
+
+bool mpsc_queue_push_batch(mpsc_queue *q, queue_node *first, queue_node *last, int n) {
+	assert(q != NULL);
+	assert(first != NULL && last != NULL);
+	assert(n > 0);
+	if(q->finish)
+		return false;
+
+	/* 整条链只需要一次交换，消费者按顺序看到链上的全部节点 */
+	atomic_add(&q->size, n);
+	ATOM_STORE_REL(&MPSC_NEXT(last), NULL);
+	queue_node *prev = ATOM_XCHG(&q->head, last);
+	ATOM_STORE_REL(&MPSC_NEXT(prev), first);
+	(void)eventcount_notify(&q->owner->ec, 1);
+
+	return true;
+}
+
+queue_node *mpsc_queue_try_pop(mpsc_queue *q) {
+	assert(q != NULL);
+	queue_node *tail = q->tail;
+	queue_node *next = ATOM_LOAD_ACQ(&MPSC_NEXT(tail));
+
+	if(tail == &q->stub) {
+		if(NULL == next)
+			return NULL;
+		q->tail = next;
+		tail = next;
+		next = ATOM_LOAD_ACQ(&MPSC_NEXT(next));
+	}
+
+	if(NULL == next) {
+		if(tail != ATOM_LOAD_ACQ(&q->head)) {
+			/* 生产者尚未完成链接 */
+			return NULL;
+		}
+		/* tail是最后一个结点，放回stub后才能取出 */
+		inner_mpsc_link(q, &q->stub);
+		next = ATOM_LOAD_ACQ(&MPSC_NEXT(tail));
+		if(NULL == next)
+			return NULL;
+	}
+
+	q->tail = next;
+	atomic_dec(&q->size);
+	return tail;
+}
+
+queue_node *mpsc_queue_pop(mpsc_queue *q) {
+	assert(q != NULL);
+	queue_node *node = NULL;
+	int round = 0;
+	while(true) {
+		node = mpsc_queue_try_pop(q);
+		if(node)
+			break;
+
+		if(!mpsc_queue_empty(q)) {
+			/* 生产者正在入队，很快就能取到 */
+			sched_yield();
+			continue;
+		}
+
+		if(ATOM_LOAD_ACQ(&q->finish))
+			break;
+
+		if(idle_strategy_backoff(&q->idle, round ++))
+			continue;
+
+		int key = eventcount_prepare(&q->ec);
+		if(!mpsc_queue_empty(q) || ATOM_LOAD_ACQ(&q->finish)) {
+			eventcount_cancel(&q->ec);
+		} else {
+			eventcount_wait(&q->ec, key, -1);
+		}
+		round = 0;
+	}
+
+	return node;
+}
+
+void mpsc_queue_finish(mpsc_queue *q) {
+	assert(q != NULL);
+	ATOM_STORE_REL(&q->finish, true);
+	(void)eventcount_notify_all(&q->ec);
+}
+
+void mpsc_queue_attach(mpsc_queue *q, mpsc_queue *owner) {
+	assert(q != NULL);
+	assert(owner != NULL && owner->owner == owner);
+	q->owner = owner;
+}
+
+static inline bool inner_mpsc_any(mpsc_queue *qs[], int n) {
+	for(int i=0; i<n; ++i) {
+		if(!mpsc_queue_empty(qs[i]))
+			return true;
+	}
+
+	return false;
+}
+
+bool mpsc_queue_wait_any(mpsc_queue *qs[], int n) {
+	assert(qs != NULL && n > 0);
+	mpsc_queue *owner = qs[0];
+	assert(owner->owner == owner);
+	int round = 0;
+	while(!inner_mpsc_any(qs, n)) {
+		if(ATOM_LOAD_ACQ(&owner->finish))
+			return false;
+
+		if(idle_strategy_backoff(&owner->idle, round ++))
+			continue;
+
+		int key = eventcount_prepare(&owner->ec);
+		if(inner_mpsc_any(qs, n) || ATOM_LOAD_ACQ(&owner->finish)) {
+			eventcount_cancel(&owner->ec);
+		} else {
+			eventcount_wait(&owner->ec, key, -1);
+		}
+		round = 0;
+	}
+
+	return true;
+}
+
+void mpsc_queue_set_idle(mpsc_queue *q, int spin, int yield) {
+	assert(q != NULL);
+	idle_strategy_init(&q->idle, spin, yield);
+}
+
+void mpsc_queue_get_idle_stat(const mpsc_queue *q, uint64_t *parks, uint64_t *wakes) {
+	assert(q != NULL);
+	*parks = ATOM_LOAD(&q->ec.parks);
+	*wakes = ATOM_LOAD(&q->ec.wakes);
+}
+
+void mpsc_queue_clear(mpsc_queue *q, queue_node_free_cb free_cb) {
+	assert(q != NULL);
+	queue_node *node = NULL;
+	if(NULL == q)
+		return;
+
+	while(!mpsc_queue_empty(q)) {
+		node = mpsc_queue_try_pop(q);
+		if(node) {
+			free_cb(node);
+		} else {
+			sched_yield();
+		}
+	}
+}
+
+/* 非线程安全 */
+void mpsc_queue_destroy(mpsc_queue **q, queue_node_free_cb free_cb) {
+	if(q && *q) {
+		mpsc_queue_clear(*q, free_cb);
+		free(*q);
+		*q = NULL;
+	}
+}
+
 /* bound block queue */
 bound_block_queue *bound_block_queue_create(int capacity) {
 	bound_block_queue *q = (bound_block_queue *)malloc(sizeof(bound_block_queue));
@@ -299,6 +511,7 @@ bound_block_queue *bound_block_queue_create(int capacity) {
 	condition_init(&q->no_empty, &q->lock);
 	q->size = 0;
 	q->capacity = capacity;
+	q->waiting = 0;
 	q->finish = false;
 	return q;
 }
@@ -338,7 +551,27 @@ bool bound_block_queue_push(bound_block_queue *q, queue_node *node) {
 		QUEUE_INSERT_TAIL(&q->queue_head, node);
 		++ q->size;
 	}
-	condition_notify(&q->no_empty);
+	if(q->waiting > 0) {
+		condition_notify(&q->no_empty);
+	}
+	MUTEX_UNLOCK(q);
+
+	return ret;
+}
+
+bool bound_block_queue_try_push(bound_block_queue *q, queue_node *node) {
+	assert(q != NULL);
+	assert(node != NULL);
+	bool ret = false;
+	MUTEX_LOCK(q);
+	if(!q->finish && !bound_block_queue_full(q)) {
+		QUEUE_INSERT_TAIL(&q->queue_head, node);
+		++ q->size;
+		if(q->waiting > 0) {
+			condition_notify(&q->no_empty);
+		}
+		ret = true;
+	}
 	MUTEX_UNLOCK(q);
 
 	return ret;
@@ -348,9 +581,11 @@ queue_node *bound_block_queue_pop(bound_block_queue *q) {
 	assert(q != NULL);
 	queue_node *node = NULL;
 	MUTEX_LOCK(q);
+	++ q->waiting;
 	while(!q->finish && bound_block_queue_empty(q)) {
 		condition_wait(&q->no_empty);
 	}
+	-- q->waiting;
 	assert(q->finish || !bound_block_queue_empty(q));
 	if(!bound_block_queue_empty(q)) {
 		node = QUEUE_HEAD(&q->queue_head);
@@ -364,6 +599,25 @@ queue_node *bound_block_queue_pop(bound_block_queue *q) {
 	return node;
 }
 
+queue_node *bound_block_queue_try_pop(bound_block_queue *q) {
+	assert(q != NULL);
+	queue_node *node = NULL;
+	/* 无锁预检，空队列不争抢锁 */
+	if(bound_block_queue_empty(q))
+		return node;
+
+	MUTEX_LOCK(q);
+	if(!bound_block_queue_empty(q)) {
+		node = QUEUE_HEAD(&q->queue_head);
+		QUEUE_REMOVE(node);
+		-- q->size;
+		condition_notify(&q->no_full);
+	}
+	MUTEX_UNLOCK(q);
+
+	return node;
+}
+
 void bound_block_queue_finish(bound_block_queue *q) {
 	assert(q != NULL);
 	MUTEX_LOCK(q);
@@ -409,3 +663,128 @@ void bound_block_queue_destroy(bound_block_queue **q, queue_node_free_cb free_cb
 	}
 }
 
+
+/* Chase-Lev work-stealing deque */
+static ws_array *inner_ws_array_create(int64_t capacity) {
+	ws_array *a = (ws_array *)malloc(sizeof(ws_array) + sizeof(queue_node *) * capacity);
+	if(a) {
+		a->capacity = capacity;
+		a->prev = NULL;
+	}
+
+	return a;
+}
+
+#define WS_SLOT(a, i)	((a)->buffer[(i) & ((a)->capacity - 1)])
+
+ws_deque *ws_deque_create(int capacity) {
+	int64_t cap = 16;
+	while(cap < capacity) {
+		cap <<= 1;
+	}
+
+	ws_deque *q = (ws_deque *)malloc(sizeof(ws_deque));
+	if(q) {
+		q->top = 0;
+		q->bottom = 0;
+		q->array = inner_ws_array_create(cap);
+		if(!q->array) {
+			free(q);
+			q = NULL;
+		}
+	}
+
+	return q;
+}
+
+int ws_deque_size(const ws_deque *q) {
+	assert(q != NULL);
+	int64_t size = ATOM_LOAD(&q->bottom) - ATOM_LOAD(&q->top);
+	return size > 0 ? (int)size : 0;
+}
+
+bool ws_deque_push(ws_deque *q, queue_node *node) {
+	assert(q != NULL);
+	assert(node != NULL);
+	int64_t b = q->bottom;
+	int64_t t = ATOM_LOAD_ACQ(&q->top);
+	ws_array *a = q->array;
+	if(b - t >= a->capacity) {
+		/* 扩容，旧数组挂在prev上 */
+		ws_array *na = inner_ws_array_create(a->capacity << 1);
+		if(!na)
+			return false;
+		for(int64_t i=t; i<b; ++i) {
+			WS_SLOT(na, i) = WS_SLOT(a, i);
+		}
+		na->prev = a;
+		ATOM_STORE_REL(&q->array, na);
+		a = na;
+	}
+	WS_SLOT(a, b) = node;
+	ATOM_STORE_REL(&q->bottom, b + 1);
+
+	return true;
+}
+
+queue_node *ws_deque_pop(ws_deque *q) {
+	assert(q != NULL);
+	int64_t b = q->bottom - 1;
+	ws_array *a = q->array;
+	q->bottom = b;
+	/* bottom的写入必须先于top的读取 */
+	FULL_BARRIER();
+	int64_t t = q->top;
+	queue_node *node = NULL;
+	if(t <= b) {
+		node = WS_SLOT(a, b);
+		if(t == b) {
+			/* 最后一个元素，与窃取者竞争 */
+			if(!ATOM_CAS_BOOL(&q->top, t, t + 1)) {
+				node = NULL;
+			}
+			q->bottom = b + 1;
+		}
+	} else {
+		q->bottom = b + 1;
+	}
+
+	return node;
+}
+
+queue_node *ws_deque_steal(ws_deque *q) {
+	assert(q != NULL);
+	int64_t t = ATOM_LOAD_ACQ(&q->top);
+	FULL_BARRIER();
+	int64_t b = ATOM_LOAD_ACQ(&q->bottom);
+	queue_node *node = NULL;
+	if(t < b) {
+		ws_array *a = ATOM_LOAD_ACQ(&q->array);
+		node = WS_SLOT(a, t);
+		if(!ATOM_CAS_BOOL(&q->top, t, t + 1)) {
+			node = NULL;
+		}
+	}
+
+	return node;
+}
+
+/* 非线程安全 */
+void ws_deque_destroy(ws_deque **q, queue_node_free_cb free_cb) {
+	if(q && *q) {
+		queue_node *node = NULL;
+		while(NULL != (node = ws_deque_pop(*q))) {
+			if(free_cb) {
+				free_cb(node);
+			}
+		}
+		ws_array *a = (*q)->array;
+		while(a) {
+			ws_array *prev = a->prev;
+			free(a);
+			a = prev;
+		}
+		free(*q);
+		*q = NULL;
+	}
+}
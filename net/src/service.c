@@ -19,15 +19,48 @@
 #include <module.h>
 #include <service.h>
 #include <logger.h>
+#include <epoch.h>
+#include <eventcount.h>
+#include <coroutine.h>
 
 typedef struct {
 	uint16_t port;
 	int sockfd;
 	net_acceptor *acceptor;
 	ARRAY connections;			/* net_connection **/
-	unpake_fn unpack;
+	unpake_fn unpack;			/* 原子读写，loop线程无锁读取 */
 } inner_acceptor;
 
+/* *
+ * 协程模式
+ * 每次调度的SIG_SERVICE_START在一个协程中执行，qcall_await挂起当前协程并按session登记，
+ * 应答经由服务自己的取消息函数截获，协程放入就绪链表，由本次调度依次恢复
+ * 只被当前调度访问，不需要加锁；co_waiter位于挂起协程的栈上
+ * */
+#define CO_WAIT_BUCKETS	64		/* 2的幂 */
+
+typedef struct co_waiter {
+	int session;
+	coroutine *co;
+	message *reply;
+	struct co_waiter *next;
+} co_waiter;
+
+typedef struct co_table {
+	co_waiter *buckets[CO_WAIT_BUCKETS];
+	co_waiter *ready_head;
+	co_waiter *ready_tail;
+	int waiting;					/* 等待应答的协程数 */
+	int errcode;					/* 最近结束的START协程的返回值 */
+} co_table;
+
+/* 分片服务的实例表，发布后只读，随主实例一起释放 */
+typedef struct shard_group {
+	int size;
+	uint32_t rr;					/* 轮询计数 */
+	HANDLE handles[];			/* handles[0]是主实例 */
+} shard_group;
+
 typedef struct service {
 	uint16_t handle;			/* INVAILD_SERVICE_HANDLE(uint16_t表示为65535) */
 	char *name;
@@ -38,15 +71,66 @@ typedef struct service {
 	// block_queue *msg_queue;		/* message queue */
 	module *mod;					/* module cache */
 	logger *log;					/* logger */
+	threadpool_task task;		/* servlet调度任务，同一时刻最多提交一次 */
+	int refs;					/* 服务表和已提交的task各持有一个引用，降为0时才释放 */
+	int budget_msgs;				/* 单次调度最多处理的消息数 */
+	double budget_time;			/* 单次调度最长运行时间(秒) */
+	int weight;					/* 公平调度权重，时间片和消息预算按weight/SERVICE_WEIGHT_DEFAULT缩放 */
+	int64_t credit;				/* DRR额度(微秒)，超用时为负，只由当前调度修改 */
+	uint64_t run_us;				/* 累计运行时间(微秒) */
+	uint64_t activations;		/* 实际运行的调度次数 */
+	uint64_t skips;				/* 额度不足而让出的调度次数 */
+	uint64_t max_slice_us;		/* 单次调度的最长运行时间 */
+	HANDLE group;				/* 所属分片组的主实例，非分片服务为自身 */
+	shard_group *shards;			/* 只有分片组的主实例非NULL */
+	int high_water;				/* 邮箱深度达到高水位时停止读取连接，0表示不限制 */
+	int low_water;				/* 降到低水位时恢复读取 */
+	atomic_t throttled;			/* 是否已停止读取 */
+	co_table *co;				/* 协程模式，NULL表示未开启 */
 } service;
 
+/* *
+ * 服务名(包括别名)-->service handle 索引
+ * 开放寻址哈希表，写者在name_lock保护下原地修改，读者在epoch临界区内无锁访问：
+ *   插入先写hash和handle，最后发布name；删除只把handle置为无效，name留作墓碑，
+ *   同名再次注册时复用墓碑
+ * 已用槽位(含墓碑)超过一半时按存活数扩容重建，存活的名字字符串直接移入新表，
+ * 墓碑的名字和旧表一起交给epoch延迟释放
+ * */
+typedef struct name_entry {
+	uint32_t hash;
+	HANDLE handle;			/* 无效表示已删除 */
+	char *name;				/* NULL表示空槽 */
+} name_entry;
+
+typedef struct name_index {
+	int capacity;			/* 2的幂 */
+	int used;				/* 非空槽位数，包括墓碑 */
+	int live;				/* 有效名字数 */
+	name_entry entries[];
+} name_index;
+
+/* 协议表，发布后只读，修改时整表复制 */
+typedef struct protocol_table {
+	int size;
+	service_protocol protocols[];
+} protocol_table;
+
+#define NAME_INDEX_MIN_CAPACITY	64
+
+/* *
+ * 以下各表读多写少：读者在epoch临界区内用ATOM_LOAD_ACQ无锁读取，
+ * 写者在lock保护下用ATOM_STORE_REL发布，被替换的对象交给epoch延迟释放
+ * */
 typedef struct service_pool {
 	uint16_t ports[PORT_POOL_SIZE];			/* port-->service handle */
 	inner_acceptor *acceptors[PORT_POOL_SIZE]; /* port-->inner_acceptor * */
 	service * services[SERVICE_POOL_SIZE]; 	/* service handle-->service  services[INVAILD_SERVICE_HANDLE]不能被使用 */
-	ARRAY protocols;			/* service_protocol */
-	/* tire *alias */
-	spinlock lock;
+	protocol_table *protocols;
+	name_index *names;		/* 当前发布的名字索引 */
+	spinlock name_lock;		/* 只保护名字索引的写者 */
+	spinlock lock;			/* 只保护写者 */
+	eventcount state_ec;		/* 服务状态、名字索引变化或启动节点完成时唤醒等待者 */
 	// queue *trash_msg;		/* console message queue 使用普通队列不可以等待*/
 } service_pool;
 
@@ -56,10 +140,16 @@ static service_pool *S = NULL;
 /* 每次任务调度都需要重新赋值 */
 __thread HANDLE t_selfHandle = INVAILD_SERVICE_HANDLE;
 __thread service *t_selfService = NULL;
+/* 本次调度剩余可处理的消息数，< 0 表示不限制 */
+__thread int t_msgBudget = -1;
+
+static inline service *inner_service_get(HANDLE handle) {
+	return ATOM_LOAD_ACQ(&S->services[handle]);
+}
 
 static inline void inner_servicethread_init(HANDLE handle) {
 	t_selfHandle = handle;
-	t_selfService = S->services[handle];
+	t_selfService = inner_service_get(handle);
 }
 
 static inline void inner_servicethread_release() {
@@ -76,6 +166,157 @@ static inline int inner_service_signal(module *mod, HANDLE handle, signalno no)
 	return ret;
 }
 
+/* FNV-1a */
+static inline uint32_t inner_name_hash(const char *name) {
+	uint32_t hash = 2166136261u;
+	while(*name) {
+		hash ^= (unsigned char)*name ++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static name_index *inner_name_index_create(int capacity) {
+	name_index *idx = (name_index *)malloc(sizeof(name_index) + sizeof(name_entry) * capacity);
+	if(TEST_VAILD_PTR(idx)) {
+		idx->capacity = capacity;
+		idx->used = 0;
+		idx->live = 0;
+		memset(idx->entries, 0, sizeof(name_entry) * capacity);
+	}
+
+	return idx;
+}
+
+/* 释放索引和它持有的全部名字，只能在没有读者时调用 */
+static void inner_name_index_destroy(void *ptr) {
+	name_index *idx = (name_index *)ptr;
+	if(TEST_VAILD_PTR(idx)) {
+		for(int i=0; i<idx->capacity; ++i) {
+			FREE(idx->entries[i].name);
+		}
+		FREE(idx);
+	}
+}
+
+static name_entry *inner_name_index_find(const name_index *idx, const char *name, uint32_t hash) {
+	int mask = idx->capacity - 1;
+	for(int i=hash & mask; ; i=(i + 1) & mask) {
+		name_entry *entry = (name_entry *)&idx->entries[i];
+		const char *ename = ATOM_LOAD_ACQ(&entry->name);
+		if(!TEST_VAILD_PTR(ename))
+			return NULL;
+		if(entry->hash == hash && 0 == strcmp(ename, name))
+			return entry;
+	}
+}
+
+static HANDLE inner_name_index_query(const name_index *idx, const char *name) {
+	if(!TEST_VAILD_PTR(idx))
+		return INVAILD_SERVICE_HANDLE;
+
+	name_entry *entry = inner_name_index_find(idx, name, inner_name_hash(name));
+	return TEST_VAILD_PTR(entry) ? ATOM_LOAD_ACQ(&entry->handle) : INVAILD_SERVICE_HANDLE;
+}
+
+/* 在空槽上发布一个名字，name的所有权转移给索引 */
+static void inner_name_index_put(name_index *idx, char *name, uint32_t hash, HANDLE handle) {
+	int mask = idx->capacity - 1;
+	for(int i=hash & mask; ; i=(i + 1) & mask) {
+		name_entry *entry = &idx->entries[i];
+		if(!TEST_VAILD_PTR(entry->name)) {
+			entry->hash = hash;
+			entry->handle = handle;
+			ATOM_STORE_REL(&entry->name, name);
+			++ idx->used;
+			++ idx->live;
+			return;
+		}
+	}
+}
+
+/* *
+ * 按存活数重建，保证下次重建前至少还能插入同样多的名字
+ * 存活的名字移入新表，墓碑的名字和旧表交给epoch
+ * */
+static bool inner_name_index_rebuild() {
+	name_index *old = S->names;
+	int live = TEST_VAILD_PTR(old) ? old->live : 0;
+	int capacity = NAME_INDEX_MIN_CAPACITY;
+	while(capacity < (live + 1) * 4) {
+		capacity <<= 1;
+	}
+
+	name_index *idx = inner_name_index_create(capacity);
+	if(!TEST_VAILD_PTR(idx))
+		return false;
+
+	for(int i=0; TEST_VAILD_PTR(old) && i<old->capacity; ++i) {
+		name_entry *entry = &old->entries[i];
+		if(!TEST_VAILD_PTR(entry->name))
+			continue;
+		if(TEST_VAILD_SERVICE_HANDLE(entry->handle)) {
+			inner_name_index_put(idx, entry->name, entry->hash, entry->handle);
+		} else {
+			epoch_retire(entry->name, free);
+		}
+	}
+
+	ATOM_STORE_REL(&S->names, idx);
+	if(TEST_VAILD_PTR(old)) {
+		/* 名字的所有权已经转移，旧表只释放自身 */
+		epoch_retire(old, free);
+	}
+
+	return true;
+}
+
+/* *
+ * 插入(handle有效)或删除(handle无效)一个名字
+ * 名字已存在时插入失败，保持先注册者
+ * */
+static int inner_name_index_update(const char *name, HANDLE handle) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_PTR(name);
+	int errcode = ERROR_FAILD;
+	bool insert = TEST_VAILD_SERVICE_HANDLE(handle);
+	uint32_t hash = inner_name_hash(name);
+	spinlock_lock(&S->name_lock);
+	name_entry *entry = TEST_VAILD_PTR(S->names) ? inner_name_index_find(S->names, name, hash) : NULL;
+	bool exist = TEST_VAILD_PTR(entry) && TEST_VAILD_SERVICE_HANDLE(entry->handle);
+	if(!insert && exist) {
+		ATOM_STORE_REL(&entry->handle, INVAILD_SERVICE_HANDLE);
+		-- S->names->live;
+		errcode = ERROR_SUCCESS;
+	} else if(insert && TEST_VAILD_PTR(entry) && !exist) {
+		/* 复用墓碑 */
+		ATOM_STORE_REL(&entry->handle, handle);
+		++ S->names->live;
+		errcode = ERROR_SUCCESS;
+	} else if(insert && !exist) {
+		char *dup = strdup(name);
+		if(TEST_VAILD_PTR(dup)) {
+			if((!TEST_VAILD_PTR(S->names) || (S->names->used + 1) * 2 > S->names->capacity) &&
+					!inner_name_index_rebuild()) {
+				FREE(dup);
+			} else {
+				inner_name_index_put(S->names, dup, hash, handle);
+				errcode = ERROR_SUCCESS;
+			}
+		}
+	}
+	spinlock_unlock(&S->name_lock);
+
+	if(TEST_SUCCESS(errcode)) {
+		/* 等待该名字出现的service_wait可以继续 */
+		(void)eventcount_notify_all(&S->state_ec);
+	}
+
+	return errcode;
+}
+
+
 static message *default_raw_unpack(buffer *buf) {
 	CHECK_VAILD_PTR(buf);
 	CHECK(buffer_get_readable(buf) != 0);
@@ -98,17 +339,14 @@ static message *default_cmd_unpack(buffer *buf) {
 	char *eof = buffer_find_eol(buf);
 	if(TEST_VAILD_PTR(eof)) {
 		size_t size = eof - buffer_peek(buf) + 1;
-		char *data = malloc(size);
-		if(TEST_VAILD_PTR(data)) {
-			memcpy(data, buffer_peek(buf), size);
-			data[size - 1] = '\0';
-			message *msg = quick_gen_msg(INVAILD_SERVICE_HANDLE, 0, (void *)data, size, MSG_RAW | MSG_CPY);
-			if(TEST_VAILD_PTR(msg)) {
-				buffer_retrieve(buf, size);
-			}
-
-			return msg;
+		/* 命令行通常很短，直接拷贝到消息的内联存储；管理命令走高优先级通道 */
+		message *msg = quick_gen_msg_copy(INVAILD_SERVICE_HANDLE, 0, buffer_peek(buf), size, MSG_RAW | MSG_CPY | MSG_PRI);
+		if(TEST_VAILD_PTR(msg)) {
+			((char *)msg->data)[size - 1] = '\0';
+			buffer_retrieve(buf, size);
 		}
+
+		return msg;
 	} else {
 		fprintf(stderr, "%s", "cmd form error!\n");
 		buffer_retrieve_all(buf);
@@ -118,16 +356,34 @@ static message *default_cmd_unpack(buffer *buf) {
 
 static unpake_fn g_defaultProto = default_raw_unpack;
 
+static protocol_table *inner_protocol_table_create(int size) {
+	protocol_table *table = (protocol_table *)malloc(sizeof(protocol_table) + sizeof(service_protocol) * size);
+	if(TEST_VAILD_PTR(table)) {
+		table->size = size;
+	}
+
+	return table;
+}
+
+static void inner_protocol_table_destroy(void *ptr) {
+	FREE(ptr);
+}
+
+static void *inner_dispatch_routine(void *input, int *errcode);
+
 int service_init() {
 	MALLOC_DEF(sp, service_pool);
 	int errcode = ERROR_FAILD;
 	if(TEST_VAILD_PTR(sp)) {
-		ARRAY_NEW(sp->protocols);
+		sp->protocols = inner_protocol_table_create(0);
 		if(TEST_VAILD_PTR(sp->protocols)) {
 			ZERO(sp->services);
 			ZERO(sp->acceptors);
 			memset(sp->ports, 0xFF, sizeof sp->ports);
+			NUL(sp->names);
+			spinlock_init(&sp->name_lock);
 			SPIN_INIT(sp);
+			eventcount_init(&sp->state_ec);
 			S = sp;
 
 			/* register trash mailbox */
@@ -155,7 +411,7 @@ int service_init() {
 				return errcode;
 			}
 
-			ARRAY_DESTROY(sp->protocols);
+			FREE(sp->protocols);
 		}
 
 		FREE(sp);
@@ -168,7 +424,7 @@ void service_release() {
 	if(TEST_VAILD_PTR(S)) {
 		/* 各种资源的释放 */
 		// TODO
-		SPIN_LOCK(S);
+		/* service_unregister内部会加锁 */
 		context_unregister_mailbox(INVAILD_SERVICE_HANDLE);
 		for(int i=0; i<SERVICE_POOL_SIZE-1; ++i) {
 			if(TEST_VAILD_PTR(S->services[i])) {
@@ -178,24 +434,38 @@ void service_release() {
 			}
 
 		}
-		ARRAY_DESTROY(S->protocols);
-		SPIN_UNLOCK(S);
+		for(int i=0; i<S->protocols->size; ++i) {
+			FREE(S->protocols->protocols[i].name);
+		}
+		inner_protocol_table_destroy(S->protocols);
+		inner_name_index_destroy(S->names);
+		/* 此时已经没有读者 */
+		epoch_release();
+		spinlock_destroy(&S->name_lock);
 		SPIN_DESTROY(S);
 		FREE(S);
 	}
 }
 
-module *service_get_module(HANDLE handle) {
-	CHECK_VAILD_SERVICE_HANDLE(handle);
-	SPIN_LOCK(S);
-	service *s = S->services[handle];
-	CHECK_VAILD_PTR(s);
-	module *mod = s->mod;
+/* 调用者保证s有效：在epoch临界区内或者持有引用 */
+static module *inner_service_module(service *s) {
+	module *mod = ATOM_LOAD_ACQ(&s->mod);
 	if(!TEST_VAILD_PTR(mod)) {
+		/* 多个线程同时查询得到的是同一个module */
 		mod = module_query(s->name);
-		s->mod = mod;
+		ATOM_STORE_REL(&s->mod, mod);
 	}
-	SPIN_UNLOCK(S);
+
+	return mod;
+}
+
+module *service_get_module(HANDLE handle) {
+	CHECK_VAILD_SERVICE_HANDLE(handle);
+	epoch_enter();
+	service *s = inner_service_get(handle);
+	CHECK_VAILD_PTR(s);
+	module *mod = inner_service_module(s);
+	epoch_leave();
 
 	return mod;
 }
@@ -211,17 +481,17 @@ void service_register_type(HANDLE service_handle, service_type type) {
 */
 void service_switch_type(HANDLE service_handle, service_type type) {
 	CHECK(type >= TYPE_SERVICE && type <= TYPE_SERVLET);
-	SPIN_LOCK(S);
-	service *s = S->services[service_handle];
+	epoch_enter();
+	service *s = inner_service_get(service_handle);
 	CHECK_VAILD_PTR(s);
 	service_type otype = s->type;
-	SPIN_UNLOCK(S);
+	epoch_leave();
 
 	if(otype != type) {
 		if(TYPE_SERVLET == otype) {
 			/* servlet->service */
 			SPIN_LOCK(S);
-			service *s = S->services[service_handle];
+			service *s = inner_service_get(service_handle);
 			CHECK_VAILD_PTR(s);
 			s->type = type;
 			SPIN_UNLOCK(S);
@@ -244,6 +514,21 @@ HANDLE service_register(const char *sname, service_type type) {
 		s->type = type;
 		s->name = strdup(sname);
 		NUL(s->mod);
+		s->budget_msgs = DEFAULT_DISPATCH_MSG_BUDGET;
+		s->budget_time = DEFAULT_DISPATCH_TIME_BUDGET;
+		s->weight = SERVICE_WEIGHT_DEFAULT;
+		s->credit = 0;
+		s->run_us = 0;
+		s->activations = 0;
+		s->skips = 0;
+		s->max_slice_us = 0;
+		NUL(s->shards);
+		NUL(s->co);
+		s->high_water = DEFAULT_MAILBOX_HIGH_WATER;
+		s->low_water = DEFAULT_MAILBOX_LOW_WATER;
+		atomic_set(&s->throttled, false);
+		s->refs = 1;
+		threadpool_task_init(&s->task, inner_dispatch_routine, s, NULL);
 		ARRAY_NEW(s->alias);
 		ARRAY_NEW(s->acceptors);
 		s->log = logger_create();
@@ -256,12 +541,15 @@ HANDLE service_register(const char *sname, service_type type) {
 			}
 
 			s->handle = tmp;
+			s->group = tmp;
 			s->state = SERVICE_NOSTART;
 			SPIN_LOCK(S);
-			S->services[s->handle] = s;
+			ATOM_STORE_REL(&S->services[s->handle], s);
 			SPIN_UNLOCK(S);
 			/* register mailbox */
 			CHECK_SUCCESS(context_register_mailbox(s->handle));
+			/* 同名服务只索引第一个 */
+			(void)inner_name_index_update(s->name, s->handle);
 			return handle = s->handle;
 		}
 		ARRAY_DESTROY(s->alias);
@@ -281,15 +569,94 @@ static void inner_connect_destroyed_adapter(void *args) {
 	connection_destroy(&conn);
 }
 
+static void inner_acceptor_free(void *ptr) {
+	inner_acceptor *inacc = (inner_acceptor *)ptr;
+	ARRAY_DESTROY(inacc->connections);
+	FREE(inacc);
+}
+
+/* 释放co_waiter链表上的协程和已经截获的应答，waiter位于协程栈上，先读出再销毁协程 */
+static void inner_co_waiter_discard(co_waiter *waiter) {
+	while(TEST_VAILD_PTR(waiter)) {
+		co_waiter *next = waiter->next;
+		coroutine *co = waiter->co;
+		message *reply = waiter->reply;
+		if(TEST_VAILD_PTR(reply)) {
+			message_free_data(reply);
+			message_free(reply);
+		}
+		coroutine_destroy(co);
+		waiter = next;
+	}
+}
+
+/* 服务注销时仍然挂起的协程不会再被恢复，连同栈一起回收 */
+static void inner_co_table_destroy(co_table *table) {
+	for(int i=0; i<CO_WAIT_BUCKETS; ++i) {
+		inner_co_waiter_discard(table->buckets[i]);
+	}
+	inner_co_waiter_discard(table->ready_head);
+	FREE(table);
+}
+
+static void inner_service_free(void *ptr) {
+	service *s = (service *)ptr;
+	if(TEST_VAILD_PTR(s->shards)) {
+		FREE(s->shards);
+	}
+	if(TEST_VAILD_PTR(s->co)) {
+		inner_co_table_destroy(s->co);
+		NUL(s->co);
+	}
+	ARRAY_DESTROY(s->alias);
+	ARRAY_DESTROY(s->acceptors);
+	logger_destroy(&s->log);
+	FREE(s->name);
+	FREE(s);
+}
+
+/* *
+ * 提交s->task之前取得引用，task在队列中或运行时s不会被释放
+ * 引用已经降为0(服务已注销)时失败，调用者必须在epoch临界区内
+ * */
+static bool inner_service_ref(service *s) {
+	int refs = ATOM_LOAD_ACQ(&s->refs);
+	while(refs > 0) {
+		int old = ATOM_CAS_OLD(&s->refs, refs, refs + 1);
+		if(old == refs)
+			return true;
+		refs = old;
+	}
+
+	return false;
+}
+
+static void inner_service_unref(service *s) {
+	if(0 == ATOM_DEC_NEW(&s->refs)) {
+		/* 其他线程可能仍在epoch临界区内读取s，延迟释放 */
+		epoch_retire(s, inner_service_free);
+	}
+}
+
 void service_unregister(HANDLE service_handle) {
 	CHECK_VAILD_PTR(S);
 	CHECK_VAILD_SERVICE_HANDLE(service_handle);
-	SPIN_LOCK(S);
-	service *s = S->services[service_handle];
+	service *s = inner_service_get(service_handle);
 	CHECK(s->handle == service_handle);
-	NUL(S->services[service_handle]);
 
+	/* 先从名字索引中移除，之后的名字查找不会再得到该handle */
+	if(service_handle == service_get_handle(s->name)) {
+		(void)inner_name_index_update(s->name, INVAILD_SERVICE_HANDLE);
+	}
+	ARRAY_FOREACH(alias, s->alias, char *) {
+		(void)inner_name_index_update(*alias, INVAILD_SERVICE_HANDLE);
+		FREE(*alias);
+	}
+
+	SPIN_LOCK(S);
+	ATOM_STORE_REL(&S->services[service_handle], NULL);
 	SPIN_UNLOCK(S);
+	(void)eventcount_notify_all(&S->state_ec);
 
 	/* release acceptor */
 	net_acceptor *acceptor;
@@ -299,8 +666,8 @@ void service_unregister(HANDLE service_handle) {
 		SPIN_LOCK(S);
 		acceptor = (*ptr)->acceptor;
 		CHECK((*ptr)==S->acceptors[port]);
-		NUL(S->acceptors[port]);
-		S->ports[port] = INVAILD_SERVICE_HANDLE;
+		ATOM_STORE_REL(&S->acceptors[port], NULL);
+		ATOM_STORE_REL(&S->ports[port], INVAILD_SERVICE_HANDLE);
 		SPIN_UNLOCK(S);
 		/* release connection */
 		ARRAY_FOREACH(conn, (*ptr)->connections, net_connection *) {
@@ -310,24 +677,39 @@ void service_unregister(HANDLE service_handle) {
 			/* 回调函数中释放connection内存 */
 			eventloop_run_pending(acceptor_get_eventloop(acceptor), entry);
 		}
+		/* loop线程可能仍在读取 */
+		epoch_retire(*ptr, inner_acceptor_free);
 	}
 
-	ARRAY_DESTROY(s->alias);
-	ARRAY_DESTROY(s->acceptors);
 	/* unregister mailbox */
 	context_unregister_mailbox(service_handle);
-	logger_destroy(&s->log);
-	FREE(s);
+	/* 交还服务表的引用，排队或运行中的task结束后才释放 */
+	inner_service_unref(s);
+}
+
+/* 调用者持有锁，发布新表并延迟释放旧表 */
+static void inner_protocol_table_publish(protocol_table *table) {
+	protocol_table *old = S->protocols;
+	ATOM_STORE_REL(&S->protocols, table);
+	epoch_retire(old, inner_protocol_table_destroy);
 }
 
 int service_register_protocol(service_protocol *protocol) {
 	CHECK_VAILD_PTR(S);
 	CHECK_VAILD_PTR(protocol);
+	int errcode = ERROR_FAILD;
 	SPIN_LOCK(S);
-	ARRAY_PUSH_BACK(S->protocols, service_protocol, *protocol);
+	protocol_table *old = S->protocols;
+	protocol_table *table = inner_protocol_table_create(old->size + 1);
+	if(TEST_VAILD_PTR(table)) {
+		memcpy(table->protocols, old->protocols, sizeof(service_protocol) * old->size);
+		table->protocols[old->size] = *protocol;
+		inner_protocol_table_publish(table);
+		errcode = ERROR_SUCCESS;
+	}
 	SPIN_UNLOCK(S);
 
-	return ERROR_SUCCESS;
+	return errcode;
 }
 
 int service_update_protocol(service_protocol *protocol) {
@@ -335,10 +717,16 @@ int service_update_protocol(service_protocol *protocol) {
 	CHECK_VAILD_PTR(protocol);
 	int errcode = ERROR_FAILD;
 	SPIN_LOCK(S);
-	ARRAY_FOREACH(ptr, S->protocols, service_protocol) {
-		if(0 == strcmp(ptr->name, protocol->name)) {
-			ptr->fn = protocol->fn;
-			errcode = ERROR_SUCCESS;
+	protocol_table *old = S->protocols;
+	for(int i=0; i<old->size; ++i) {
+		if(0 == strcmp(old->protocols[i].name, protocol->name)) {
+			protocol_table *table = inner_protocol_table_create(old->size);
+			if(TEST_VAILD_PTR(table)) {
+				memcpy(table->protocols, old->protocols, sizeof(service_protocol) * old->size);
+				table->protocols[i].fn = protocol->fn;
+				inner_protocol_table_publish(table);
+				errcode = ERROR_SUCCESS;
+			}
 			break;
 		}
 	}
@@ -350,10 +738,17 @@ void service_unregister_protocol(const char *name) {
 	CHECK_VAILD_PTR(S);
 	CHECK_VAILD_PTR(name);
 	SPIN_LOCK(S);
-	ARRAY_FOREACH(ptr, S->protocols, service_protocol) {
-		if(0 == strcmp(ptr->name, name)) {
-			FREE(ptr->name);
-			ARRAY_REMOVE(S->protocols, service_protocol, ARRAY_INDEX(ptr, S->protocols, service_protocol));
+	protocol_table *old = S->protocols;
+	for(int i=0; i<old->size; ++i) {
+		if(0 == strcmp(old->protocols[i].name, name)) {
+			protocol_table *table = inner_protocol_table_create(old->size - 1);
+			if(TEST_VAILD_PTR(table)) {
+				memcpy(table->protocols, old->protocols, sizeof(service_protocol) * i);
+				memcpy(table->protocols + i, old->protocols + i + 1, sizeof(service_protocol) * (old->size - i - 1));
+				/* 读者可能仍在比较名字 */
+				epoch_retire(old->protocols[i].name, free);
+				inner_protocol_table_publish(table);
+			}
 			break;
 		}
 	}
@@ -368,23 +763,26 @@ unpake_fn service_query_unpack(const char *name) {
 	if(!TEST_VAILD_PTR(name))
 		return unpack;
 
-	SPIN_LOCK(S);
-	ARRAY_FOREACH(prot, S->protocols, service_protocol) {
-		if(0 == strcmp(name, prot->name)) {
-			unpack = prot->fn;
+	epoch_enter();
+	protocol_table *table = ATOM_LOAD_ACQ(&S->protocols);
+	for(int i=0; i<table->size; ++i) {
+		if(0 == strcmp(name, table->protocols[i].name)) {
+			unpack = table->protocols[i].fn;
 			break;
 		}
 	}
-	SPIN_UNLOCK(S);
+	epoch_leave();
 
 	return unpack;
 }
 
 int service_config_protocol(uint16_t port, const char *name) {
 	CHECK_VAILD_PTR(S);
+	/* 先查询协议，service_query_unpack不加锁 */
+	unpake_fn unpack = service_query_unpack(name);
 	SPIN_LOCK(S);
 	CHECK_VAILD_PTR(S->acceptors[port]);
-	S->acceptors[port]->unpack = service_query_unpack(name);
+	ATOM_STORE_REL(&S->acceptors[port]->unpack, unpack);
 	SPIN_UNLOCK(S);
 
 	return ERROR_SUCCESS;
@@ -398,16 +796,133 @@ static void inner_connect_established_adapter(void *args) {
 	connection_connect_established(conn);
 }
 
+/* splitmix64的终结函数，连续的fd也能均匀分布 */
+static inline uint64_t inner_shard_hash(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+/* 调用者在epoch临界区内 */
+static inline HANDLE inner_service_route(service *s, uint64_t key) {
+	shard_group *group = ATOM_LOAD_ACQ(&s->shards);
+	if(likely(!TEST_VAILD_PTR(group)))
+		return s->handle;
+
+	uint32_t index = SERVICE_ROUTE_RR == key ? ATOM_INC_OLD(&group->rr) :
+			(uint32_t)inner_shard_hash(key);
+	return group->handles[index % group->size];
+}
+
+HANDLE service_route(HANDLE service_handle, uint64_t key) {
+	if(!TEST_VAILD_SERVICE_HANDLE(service_handle))
+		return service_handle;
+
+	epoch_enter();
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s)) {
+		service_handle = inner_service_route(s, key);
+	}
+	epoch_leave();
+
+	return service_handle;
+}
+
+/* *
+ * 邮箱水位流控
+ * 高水位在loop线程投递消息后检查，低水位在消费者取出消息后检查，
+ * throttled的翻转由CAS保证只有一方执行，真正的停止/恢复都在loop线程中按当前状态进行
+ * */
+static void inner_flow_apply(void *args) {
+	HANDLE handle = (HANDLE)(intptr_t)args;
+	epoch_enter();
+	service *s = inner_service_get(handle);
+	/* 分片实例的连接挂在主实例的acceptor上，只处理分发到本实例的连接 */
+	service *owner = TEST_VAILD_PTR(s) ? inner_service_get(s->group) : NULL;
+	if(TEST_VAILD_PTR(owner)) {
+		bool throttled = atomic_get(&s->throttled);
+		/* connections只在loop线程中修改，acceptors由写锁保护 */
+		SPIN_LOCK(S);
+		ARRAY_FOREACH(ptr, owner->acceptors, inner_acceptor *) {
+			ARRAY_FOREACH(conn, (*ptr)->connections, net_connection *) {
+				if(!connection_test_connected(*conn))
+					continue;
+				if(handle != inner_service_route(owner, connection_get_socket(*conn).sockfd))
+					continue;
+				if(throttled) {
+					connection_stop_read(*conn);
+				} else {
+					connection_start_read(*conn);
+				}
+			}
+		}
+		SPIN_UNLOCK(S);
+	}
+	epoch_leave();
+}
+
+static void inner_flow_post(HANDLE handle) {
+	net_eventloop *loop = context_select_eventloop();
+	if(TEST_VAILD_PTR(loop)) {
+		pending_entry entry;
+		entry.args = (void *)(intptr_t)handle;
+		entry.callback = inner_flow_apply;
+		eventloop_run_pending(loop, entry);
+	}
+}
+
+static inline void inner_flow_check_low(HANDLE handle);
+
+static void inner_flow_check_high(HANDLE handle) {
+	epoch_enter();
+	service *s = inner_service_get(handle);
+	bool stop = TEST_VAILD_PTR(s) && s->high_water > 0 &&
+			context_get_mail_depth(handle) >= (size_t)s->high_water &&
+			atomic_cas(&s->throttled, false, true);
+	epoch_leave();
+
+	if(stop) {
+		inner_flow_post(handle);
+		/* 消费者可能在置位之前已经取空邮箱，之后不会再检查低水位 */
+		inner_flow_check_low(handle);
+	}
+}
+
+static inline void inner_flow_check_low(HANDLE handle) {
+	/* consume的更新必须先于throttled的读取，与高水位一侧的CAS配对 */
+	FULL_BARRIER();
+	epoch_enter();
+	service *s = inner_service_get(handle);
+	bool resume = TEST_VAILD_PTR(s) && atomic_get(&s->throttled) &&
+			context_get_mail_depth(handle) <= (size_t)s->low_water &&
+			atomic_cas(&s->throttled, true, false);
+	epoch_leave();
+
+	if(resume) {
+		inner_flow_post(handle);
+	}
+}
+
 static void inner_message_callback(void *args, buffer* buf, timestamp ts) {
 	net_connection *conn = (net_connection *)args;
 	CHECK_VAILD_PTR(conn);
 	net_socket sock = connection_get_socket(conn);
 	uint16_t port = socket_get_port(&sock);
-	SPIN_LOCK(S);
-	unpake_fn unpack = S->acceptors[port]->unpack;
-	HANDLE handle = S->ports[port];
+	epoch_enter();
+	inner_acceptor *inacc = ATOM_LOAD_ACQ(&S->acceptors[port]);
+	CHECK_VAILD_PTR(inacc);
+	unpake_fn unpack = ATOM_LOAD_ACQ(&inacc->unpack);
+	HANDLE handle = ATOM_LOAD_ACQ(&S->ports[port]);
 	CHECK(handle != INVAILD_SERVICE_HANDLE);
-	SPIN_UNLOCK(S);
+	service *s = inner_service_get(handle);
+	if(TEST_VAILD_PTR(s)) {
+		/* 分片服务按fd分发，同一连接的消息总是进入同一个实例 */
+		handle = inner_service_route(s, sock.sockfd);
+	}
+	epoch_leave();
 
 	message *msg = unpack(buf);
 	if(TEST_VAILD_SERVICE_HANDLE(SERVICE_ID(msg->source))) {
@@ -421,7 +936,8 @@ static void inner_message_callback(void *args, buffer* buf, timestamp ts) {
 		}
 	}
 	msg->source = HARBOR_ID(context_get_nodeid(), handle);
-	service_push_message(handle, msg);
+	/* 本轮事件循环读到的消息在结束时合并投递，高水位在service_push_messages中每批检查一次 */
+	(void)qsend_buffered_msg(handle, msg);
 }
 
 static void inner_newconn_callback(void *args, net_socket sock, net_address peeraddr) {
@@ -432,11 +948,13 @@ static void inner_newconn_callback(void *args, net_socket sock, net_address peer
 	snprintf(buf, sizeof buf, "-%s#%d", stringpiece_to_cstring(&strpie), atomic_inc(&g_genConnSeq));
 	stringpiece_clear(&strpie);
 	// 不能使用t_service，该函数的执行在loop线程中
-	SPIN_LOCK(S);
-	service *s = S->services[S->ports[inacc->port]];
+	epoch_enter();
+	service *s = inner_service_get(ATOM_LOAD_ACQ(&S->ports[inacc->port]));
 	CHECK_VAILD_PTR(s);
 	stringpiece_append(&strpie, s->name);
-	SPIN_UNLOCK(S);
+	service *instance = inner_service_get(inner_service_route(s, sock.sockfd));
+	bool throttled = TEST_VAILD_PTR(instance) && atomic_get(&instance->throttled);
+	epoch_leave();
 	stringpiece_append(&strpie, buf);
 
 	net_address localaddr = socket_get_localaddr(&sock);
@@ -453,6 +971,10 @@ static void inner_newconn_callback(void *args, net_socket sock, net_address peer
 	entry.args = conn;
 	entry.callback = inner_connect_established_adapter;
 	eventloop_run_pending(acceptor_get_eventloop(inacc->acceptor), entry);
+	if(throttled) {
+		/* 排在建立连接之后执行，服务积压时新连接先不读取 */
+		connection_stop_read(conn);
+	}
 	ARRAY_PUSH_BACK(inacc->connections, net_connection *, conn);
 	printf("accept a new connection : sockfd = %d, %s\n", sock.sockfd, stringpiece_to_cstring(&strpie));
 	stringpiece_release(&strpie);
@@ -468,11 +990,13 @@ int service_register_port(HANDLE service_handle, uint16_t port, const char *prot
 	context *ctx = global_context();
 	CHECK_VAILD_PTR(ctx);
 	CHECK_VAILD_SERVICE_HANDLE(service_handle);
-	SPIN_LOCK(S);
-	service *s = S->services[service_handle];
-	SPIN_UNLOCK(S);
+	service *s = inner_service_get(service_handle);
 	CHECK_VAILD_PTR(s);
 	int errcode = ERROR_FAILD;
+	/* 分片实例的init会重复注册同一个端口，由主实例持有，连接按fd分发到各实例 */
+	if(s->group != service_handle && s->group == S->ports[port]) {
+		return ERROR_SUCCESS;
+	}
 	/* 端口没有被占用才能够进行注册 */
 	if(INVAILD_SERVICE_HANDLE == S->ports[port]) {
 		net_address addr = netaddr4(port, false);
@@ -492,8 +1016,8 @@ int service_register_port(HANDLE service_handle, uint16_t port, const char *prot
 				ARRAY_NEW(inacc->connections);
 				if(TEST_VAILD_PTR(inacc->connections)) {
 					SPIN_LOCK(S);
-					S->ports[port] = service_handle;
-					S->acceptors[port] = inacc;
+					ATOM_STORE_REL(&S->acceptors[port], inacc);
+					ATOM_STORE_REL(&S->ports[port], service_handle);
 					ARRAY_PUSH_BACK(s->acceptors, inner_acceptor *, inacc);
 					SPIN_UNLOCK(S);
 					pending_entry entry;
@@ -517,14 +1041,20 @@ int service_register_port(HANDLE service_handle, uint16_t port, const char *prot
 	return errcode;
 }
 
+/* 状态的每次变化都唤醒所有service_wait，启动阶段变化很少，不必区分等待者 */
+static void inner_service_set_state(HANDLE service_handle, service_state state) {
+	SPIN_LOCK(S);
+	ATOM_STORE_REL(&S->services[service_handle]->state, state);
+	SPIN_UNLOCK(S);
+	(void)eventcount_notify_all(&S->state_ec);
+}
+
 static int inner_service_init(module *mod, HANDLE service_handle) {
 	return inner_service_signal(mod, service_handle, SIG_SERVICE_INIT);
 }
 
 static int inner_service_start(module *mod, HANDLE service_handle) {
-	SPIN_LOCK(S);
-	S->services[service_handle]->state = SERVICE_STARTED;
-	SPIN_UNLOCK(S);
+	inner_service_set_state(service_handle, SERVICE_STARTED);
 	service_state state;
 	service_type type;
 	int errcode = ERROR_SUCCESS;
@@ -548,9 +1078,7 @@ static int inner_service_start(module *mod, HANDLE service_handle) {
 }
 
 static int inner_service_stop(module *mod, HANDLE service_handle) {
-	SPIN_LOCK(S);
-	S->services[service_handle]->state = SERVICE_STOPPING;
-	SPIN_UNLOCK(S);
+	inner_service_set_state(service_handle, SERVICE_STOPPING);
 	return inner_service_signal(mod, service_handle, SIG_SERVICE_STOP);
 }
 
@@ -572,9 +1100,7 @@ static void inner_service_boost(void *args) {
 	module *mod = data->mod;
 	FREE(data);
 	printf("%s service starting......\n", sname);
-	SPIN_LOCK(S);
-	S->services[handle]->state = SERVICE_STARTING;
-	SPIN_UNLOCK(S);
+	inner_service_set_state(handle, SERVICE_STARTING);
 
 	int errcode = inner_service_start(mod, handle);
 	if(!TEST_SUCCESS(errcode)) {
@@ -584,9 +1110,7 @@ static void inner_service_boost(void *args) {
 	}
 
 	printf("%s service stopping......\n", sname);
-	SPIN_LOCK(S);
-	S->services[handle]->state = SERVICE_STOPPING;
-	SPIN_UNLOCK(S);
+	inner_service_set_state(handle, SERVICE_STOPPING);
 	errcode = inner_service_release(mod, handle);
 	if(!TEST_SUCCESS(errcode)) {
 		service_unregister(handle);
@@ -595,74 +1119,457 @@ static void inner_service_boost(void *args) {
 	}
 
 	printf("%s service stoped......\n", sname);
-	SPIN_LOCK(S);
-	S->services[handle]->state = SERVICE_STOPPED;
-	SPIN_UNLOCK(S);
+	inner_service_set_state(handle, SERVICE_STOPPED);
 }
 
-int service_boost(const char *sname) {
+/* 启动各阶段的时间点，用于启动报告 */
+typedef struct boot_timing {
+	timestamp init_begin;
+	timestamp init_end;
+	timestamp start_end;		/* service类型的线程已派发 */
+} boot_timing;
+
+static void inner_service_boot_start(const char *sname, HANDLE handle, module *mod) {
+	if(TYPE_SERVICE == S->services[handle]->type) {
+		MALLOC_DEF(data, inner_service_boost_data);
+		data->sname = sname;
+		data->handle = handle;
+		data->mod = mod;
+		const char *tname = sname;
+		threadpool_apply_service(inner_service_boost, (void *)data, tname);
+	}
+}
+
+/* 启动失败时注销已经注册的全部实例，主实例最后注销，分片组随主实例释放 */
+static void inner_service_boot_rollback(HANDLE primary, shard_group *group) {
+	if(TEST_VAILD_PTR(group)) {
+		for(int i=group->size-1; i>0; --i) {
+			service_unregister(group->handles[i]);
+		}
+	}
+	service_unregister(primary);
+}
+
+/* *
+ * 注册instances个实例并依次init
+ * 主实例使用sname，其余实例名为sname#i，全部注册之后再init，
+ * 这样实例init时已经知道自己所属的分片组
+ * 失败时注销全部实例并返回错误码，由调用者决定是否退出：启动图在worker上执行，不能在这里ABORT
+ * */
+static int inner_service_boot(const char *sname, int instances, boot_timing *timing) {
 	CHECK_VAILD_PTR(sname);
+	CHECK(instances >= 1);
 	module *mod = module_query(sname);
 	int errcode = ERROR_FAILD;
-	if(TEST_VAILD_PTR(mod)) {
-		HANDLE handle = service_register(sname, TYPE_SERVLET);
+	if(!TEST_VAILD_PTR(mod)) {
+		fprintf(stderr, "%s service boost faild!\n", sname);
+		return errcode;
+	}
+
+	shard_group *group = NULL;
+	if(instances > 1) {
+		group = (shard_group *)malloc(sizeof(shard_group) + sizeof(HANDLE) * instances);
+		CHECK_VAILD_PTR(group);
+		group->size = instances;
+		group->rr = 0;
+	}
+
+	HANDLE primary = INVAILD_SERVICE_HANDLE;
+	for(int i=0; i<instances; ++i) {
+		char name[MAX_SERVICE_NAME];
+		if(0 == i) {
+			snprintf(name, sizeof name, "%s", sname);
+		} else {
+			snprintf(name, sizeof name, "%s#%d", sname, i);
+		}
+		HANDLE handle = service_register(name, TYPE_SERVLET);
 		CHECK(handle != INVAILD_SERVICE_HANDLE);
+		if(0 == i) {
+			primary = handle;
+		}
+		S->services[handle]->group = primary;
+		/* 实例名sname#i没有对应的模块文件，直接使用已经加载的模块 */
+		ATOM_STORE_REL(&S->services[handle]->mod, mod);
+		if(TEST_VAILD_PTR(group)) {
+			group->handles[i] = handle;
+		}
+	}
 
-		printf("%s service initing......\n", sname);
+	if(TEST_VAILD_PTR(group)) {
 		SPIN_LOCK(S);
-		S->services[handle]->state = SERVICE_INITING;
+		ATOM_STORE_REL(&S->services[primary]->shards, group);
 		SPIN_UNLOCK(S);
-		errcode = inner_service_init(mod, handle);
+	}
 
+	if(TEST_VAILD_PTR(timing)) {
+		timing->init_begin = timestamp_now();
+	}
+	for(int i=0; i<instances; ++i) {
+		HANDLE handle = TEST_VAILD_PTR(group) ? group->handles[i] : primary;
+		printf("%s service initing......\n", S->services[handle]->name);
+		inner_service_set_state(handle, SERVICE_INITING);
+		errcode = inner_service_init(mod, handle);
 		if(!TEST_SUCCESS(errcode)) {
-			service_unregister(handle);
-			fprintf(stderr, "%s service init faild!\n", sname);
-			ABORT
+			fprintf(stderr, "%s service init faild!\n", S->services[handle]->name);
+			inner_service_boot_rollback(primary, group);
+			return errcode;
 		}
-
-		if(TYPE_SERVICE == S->services[handle]->type) {
-			MALLOC_DEF(data, inner_service_boost_data);
-			data->sname = sname;
-			data->handle = handle;
-			data->mod = mod;
-			const char *tname = sname;
-			threadpool_apply_service(inner_service_boost, (void *)data, tname);
+		if(instances > 1 && TYPE_SERVLET != S->services[handle]->type) {
+			/* service类型独占线程并共享模块的全局状态，不能分片 */
+			fprintf(stderr, "%s service is not a servlet and can not be sharded!\n", sname);
+			inner_service_boot_rollback(primary, group);
+			return ERROR_FAILD;
 		}
-	} else {
-		fprintf(stderr, "%s service boost faild!\n", sname);
+	}
+	if(TEST_VAILD_PTR(timing)) {
+		timing->init_end = timestamp_now();
+	}
+
+	inner_service_boot_start(sname, primary, mod);
+	if(TEST_VAILD_PTR(timing)) {
+		timing->start_end = timestamp_now();
+	}
+
+	return errcode;
+}
+
+/* 单独启动在主线程中调用，失败时与原来一样直接退出 */
+int service_boost(const char *sname) {
+	int errcode = inner_service_boot(sname, 1, NULL);
+	if(!TEST_SUCCESS(errcode)) {
 		ABORT
 	}
 
 	return errcode;
 }
 
-int service_batch_boost(const char *service_batch[][SERVICE_STAGE_MAX]) {
-	int errcode = ERROR_SUCCESS;
-	int i = 0;
-	while(TEST_VAILD_PTR(service_batch[i][0])) {
-		const char **snames = &service_batch[i][0];
-		int j = 0;
+int service_boost_instances(const char *sname, int instances) {
+	CHECK(instances >= 1 && instances <= MAX_SERVICE_INSTANCES);
+	int errcode = inner_service_boot(sname, instances, NULL);
+	if(!TEST_SUCCESS(errcode)) {
+		ABORT
+	}
 
-		if(i != 0) {
-			errcode |= service_batch_wait(&service_batch[i-1][0], STAGE_SINCE, SERVICE_INITING, -1);
-		}
+	return errcode;
+}
 
-		while(TEST_VAILD_PTR(snames[j])) {
-			const char *sname = snames[j];
-			errcode |= service_boost(sname);
-			if(!TEST_SUCCESS(errcode)) {
-				return errcode;
-			}
-			++ j;
+/* *
+ * 启动依赖图
+ * 每个节点的init在worker上执行，所有依赖的init完成后节点才被提交，
+ * 相互独立的服务并行初始化，主线程只等待全部结束
+ * */
+typedef struct boot_node {
+	const char *sname;
+	int instances;				/* 分片实例数 */
+	int pending;				/* 尚未完成的依赖数 */
+	ARRAY dependents;			/* boot_node * */
+	threadpool_task task;
+	struct boot_graph *graph;
+	int errcode;
+	timestamp ready;			/* 依赖全部完成的时刻 */
+	boot_timing timing;
+} boot_node;
+
+typedef struct boot_graph {
+	int size;
+	int done;					/* 已结束的节点数 */
+	int errcode;
+	timestamp begin;
+	boot_node nodes[];
+} boot_graph;
+
+static void *inner_boot_routine(void *input, int *errcode);
+
+static boot_graph *inner_boot_graph_create(int size) {
+	boot_graph *graph = (boot_graph *)calloc(1, sizeof(boot_graph) + sizeof(boot_node) * size);
+	if(!TEST_VAILD_PTR(graph))
+		return NULL;
+
+	graph->size = size;
+	graph->errcode = ERROR_SUCCESS;
+	for(int i=0; i<size; ++i) {
+		boot_node *node = &graph->nodes[i];
+		node->graph = graph;
+		node->errcode = ERROR_SUCCESS;
+		threadpool_task_init(&node->task, inner_boot_routine, node, NULL);
+	}
+
+	return graph;
+}
+
+static void inner_boot_graph_destroy(boot_graph *graph) {
+	for(int i=0; i<graph->size; ++i) {
+		if(TEST_VAILD_PTR(graph->nodes[i].dependents)) {
+			ARRAY_DESTROY(graph->nodes[i].dependents);
 		}
+	}
+	FREE(graph);
+}
 
-		if(!TEST_SUCCESS(errcode)) {
-			return errcode;
+static boot_node *inner_boot_graph_find(boot_graph *graph, const char *sname) {
+	for(int i=0; i<graph->size; ++i) {
+		if(TEST_VAILD_PTR(graph->nodes[i].sname) && 0 == strcmp(graph->nodes[i].sname, sname)) {
+			return &graph->nodes[i];
 		}
-		++ i;
 	}
 
-	return errcode;
+	return NULL;
+}
+
+/* sname可以写成"name:N"，表示启动N个分片实例 */
+static int inner_boot_graph_add(boot_graph *graph, int index, const char *sname) {
+	int instances = 1;
+	const char *colon = strchr(sname, ':');
+	if(TEST_VAILD_PTR(colon)) {
+		instances = atoi(colon + 1);
+		if(instances < 1 || instances > MAX_SERVICE_INSTANCES) {
+			fprintf(stderr, "%s service has invaild instance count!\n", sname);
+			return ERROR_FAILD;
+		}
+		/* 模块表会引用该名字，常驻不释放 */
+		sname = strndup(sname, colon - sname);
+		if(!TEST_VAILD_PTR(sname))
+			return ERROR_FAILD;
+	}
+
+	if(TEST_VAILD_PTR(inner_boot_graph_find(graph, sname))) {
+		fprintf(stderr, "%s service declared twice in boot graph!\n", sname);
+		return ERROR_FAILD;
+	}
+
+	boot_node *node = &graph->nodes[index];
+	node->sname = sname;
+	node->instances = instances;
+	ARRAY_NEW(node->dependents);
+	return TEST_VAILD_PTR(node->dependents) ? ERROR_SUCCESS : ERROR_FAILD;
+}
+
+/* 不在图中但已经注册的服务视为已完成的依赖 */
+static int inner_boot_graph_depend(boot_graph *graph, boot_node *node, const char *dep) {
+	boot_node *from = inner_boot_graph_find(graph, dep);
+	if(TEST_VAILD_PTR(from)) {
+		ARRAY_PUSH_BACK(from->dependents, boot_node *, node);
+		++ node->pending;
+		return ERROR_SUCCESS;
+	}
+
+	if(TEST_VAILD_SERVICE_HANDLE(service_get_handle(dep))) {
+		return ERROR_SUCCESS;
+	}
+
+	fprintf(stderr, "%s service depends on unknown service %s!\n", node->sname, dep);
+	return ERROR_FAILD;
+}
+
+/* 按拓扑序模拟一遍，存在环时返回失败 */
+static int inner_boot_graph_check(boot_graph *graph) {
+	int size = graph->size;
+	int *pending = (int *)malloc(sizeof(int) * size);
+	boot_node **order = (boot_node **)malloc(sizeof(boot_node *) * size);
+	int errcode = ERROR_FAILD;
+	if(TEST_VAILD_PTR(pending) && TEST_VAILD_PTR(order)) {
+		int head = 0, tail = 0;
+		for(int i=0; i<size; ++i) {
+			pending[i] = graph->nodes[i].pending;
+			if(0 == pending[i]) {
+				order[tail ++] = &graph->nodes[i];
+			}
+		}
+
+		while(head < tail) {
+			boot_node *node = order[head ++];
+			ARRAY_FOREACH(ptr, node->dependents, boot_node *) {
+				if(0 == -- pending[*ptr - graph->nodes]) {
+					order[tail ++] = *ptr;
+				}
+			}
+		}
+
+		if(tail == size) {
+			errcode = ERROR_SUCCESS;
+		} else {
+			for(int i=0; i<size; ++i) {
+				if(pending[i] > 0) {
+					fprintf(stderr, "%s service is part of a dependency cycle!\n", graph->nodes[i].sname);
+				}
+			}
+		}
+	}
+
+	FREE(pending);
+	FREE(order);
+	return errcode;
+}
+
+/* 任务队列满时在当前线程直接执行 */
+static void inner_boot_schedule(boot_node *node) {
+	node->ready = timestamp_now();
+	if(!TEST_SUCCESS(threadpool_submit(&node->task))) {
+		int errcode = ERROR_SUCCESS;
+		(void)inner_boot_routine(node, &errcode);
+	}
+}
+
+static void *inner_boot_routine(void *input, int *errcode) {
+	boot_node *node = (boot_node *)input;
+	boot_graph *graph = node->graph;
+	/* 前面已经有服务失败时不再启动，但仍然释放后继节点，保证主线程能结束等待 */
+	if(TEST_SUCCESS(ATOM_LOAD_ACQ(&graph->errcode))) {
+		node->errcode = inner_service_boot(node->sname, node->instances, &node->timing);
+	} else {
+		node->errcode = ERROR_FAILD;
+	}
+	*errcode = node->errcode;
+	if(!TEST_SUCCESS(node->errcode)) {
+		ATOM_STORE_REL(&graph->errcode, node->errcode);
+	}
+
+	ARRAY_FOREACH(ptr, node->dependents, boot_node *) {
+		if(0 == ATOM_DEC_NEW(&(*ptr)->pending)) {
+			inner_boot_schedule(*ptr);
+		}
+	}
+
+	/* done计满后主线程会立即释放graph，之后只能访问全局的state_ec */
+	ATOM_INC_NEW(&graph->done);
+	(void)eventcount_notify_all(&S->state_ec);
+	return NULL;
+}
+
+static inline double inner_boot_ms(timestamp end, timestamp begin) {
+	return timestamp_diff(end, begin) * 1000;
+}
+
+static void inner_boot_graph_report(boot_graph *graph) {
+	timestamp end = graph->begin;
+	double init_sum = 0;
+	for(int i=0; i<graph->size; ++i) {
+		boot_node *node = &graph->nodes[i];
+		if(timestamp_compare(node->timing.start_end, end) > 0) {
+			end = node->timing.start_end;
+		}
+		init_sum += inner_boot_ms(node->timing.init_end, node->timing.init_begin);
+	}
+
+	printf("service boot report : %d services, wall %.3f ms, init total %.3f ms\n",
+			graph->size, inner_boot_ms(end, graph->begin), init_sum);
+	printf("  %-16s %10s %10s %10s %10s %10s\n",
+			"service", "ready", "queue", "init", "start", "done");
+	for(int i=0; i<graph->size; ++i) {
+		boot_node *node = &graph->nodes[i];
+		if(!TEST_SUCCESS(node->errcode)) {
+			printf("  %-16s %10s\n", node->sname, "faild");
+			continue;
+		}
+		/* ready和done是相对启动开始的时刻，其余是各阶段耗时，单位毫秒 */
+		printf("  %-16s %10.3f %10.3f %10.3f %10.3f %10.3f\n", node->sname,
+				inner_boot_ms(node->ready, graph->begin),
+				inner_boot_ms(node->timing.init_begin, node->ready),
+				inner_boot_ms(node->timing.init_end, node->timing.init_begin),
+				inner_boot_ms(node->timing.start_end, node->timing.init_end),
+				inner_boot_ms(node->timing.start_end, graph->begin));
+	}
+}
+
+static int inner_boot_graph_run(boot_graph *graph) {
+	int errcode = inner_boot_graph_check(graph);
+	if(!TEST_SUCCESS(errcode))
+		return errcode;
+
+	graph->begin = timestamp_now();
+	/* 先找出所有根节点再提交，提交之后pending会被worker并发修改 */
+	int nroot = 0;
+	boot_node **roots = (boot_node **)malloc(sizeof(boot_node *) * graph->size);
+	if(!TEST_VAILD_PTR(roots))
+		return ERROR_FAILD;
+	for(int i=0; i<graph->size; ++i) {
+		if(0 == graph->nodes[i].pending) {
+			roots[nroot ++] = &graph->nodes[i];
+		}
+	}
+	for(int i=0; i<nroot; ++i) {
+		inner_boot_schedule(roots[i]);
+	}
+	FREE(roots);
+
+	while(true) {
+		int key = eventcount_prepare(&S->state_ec);
+		if(ATOM_LOAD_ACQ(&graph->done) == graph->size) {
+			eventcount_cancel(&S->state_ec);
+			break;
+		}
+		eventcount_wait(&S->state_ec, key, -1);
+	}
+
+	inner_boot_graph_report(graph);
+	return ATOM_LOAD_ACQ(&graph->errcode);
+}
+
+/* *
+ * 每行{ 服务名, 依赖1, 依赖2, ..., NULL }，以{ NULL }结束
+ * 依赖的init完成之后才开始本服务的init
+ * */
+int service_graph_boost(const char *service_graph[][SERVICE_STAGE_MAX]) {
+	CHECK_VAILD_PTR(service_graph);
+	int size = 0;
+	while(TEST_VAILD_PTR(service_graph[size][0])) {
+		++ size;
+	}
+
+	boot_graph *graph = inner_boot_graph_create(size);
+	if(!TEST_VAILD_PTR(graph))
+		return ERROR_FAILD;
+
+	int errcode = ERROR_SUCCESS;
+	for(int i=0; TEST_SUCCESS(errcode) && i<size; ++i) {
+		errcode = inner_boot_graph_add(graph, i, service_graph[i][0]);
+	}
+	for(int i=0; TEST_SUCCESS(errcode) && i<size; ++i) {
+		for(int j=1; TEST_SUCCESS(errcode) && j<SERVICE_STAGE_MAX && TEST_VAILD_PTR(service_graph[i][j]); ++j) {
+			errcode = inner_boot_graph_depend(graph, &graph->nodes[i], service_graph[i][j]);
+		}
+	}
+
+	if(TEST_SUCCESS(errcode)) {
+		errcode = inner_boot_graph_run(graph);
+	}
+	inner_boot_graph_destroy(graph);
+
+	return errcode;
+}
+
+/* 按阶段启动：每个服务依赖上一阶段的全部服务，同一阶段内并行 */
+int service_batch_boost(const char *service_batch[][SERVICE_STAGE_MAX]) {
+	CHECK_VAILD_PTR(service_batch);
+	int size = 0;
+	for(int i=0; TEST_VAILD_PTR(service_batch[i][0]); ++i) {
+		for(int j=0; j<SERVICE_STAGE_MAX && TEST_VAILD_PTR(service_batch[i][j]); ++j) {
+			++ size;
+		}
+	}
+
+	boot_graph *graph = inner_boot_graph_create(size);
+	if(!TEST_VAILD_PTR(graph))
+		return ERROR_FAILD;
+
+	int errcode = ERROR_SUCCESS;
+	int index = 0;
+	for(int i=0; TEST_SUCCESS(errcode) && TEST_VAILD_PTR(service_batch[i][0]); ++i) {
+		for(int j=0; TEST_SUCCESS(errcode) && j<SERVICE_STAGE_MAX && TEST_VAILD_PTR(service_batch[i][j]); ++j) {
+			errcode = inner_boot_graph_add(graph, index, service_batch[i][j]);
+			for(int k=0; TEST_SUCCESS(errcode) && i>0 && k<SERVICE_STAGE_MAX && TEST_VAILD_PTR(service_batch[i-1][k]); ++k) {
+				errcode = inner_boot_graph_depend(graph, &graph->nodes[index], service_batch[i-1][k]);
+			}
+			++ index;
+		}
+	}
+
+	if(TEST_SUCCESS(errcode)) {
+		errcode = inner_boot_graph_run(graph);
+	}
+	inner_boot_graph_destroy(graph);
+
+	return errcode;
 }
 
 void service_stop(const char *sname, HANDLE service_handle) {
@@ -682,30 +1589,46 @@ void service_stop(const char *sname, HANDLE service_handle) {
 HANDLE service_get_handle(const char *sname) {
 	CHECK_VAILD_PTR(S);
 	CHECK_VAILD_PTR(sname);
-	HANDLE handle = INVAILD_SERVICE_HANDLE;
-	SPIN_LOCK(S);
-	for(int i=0; i<SERVICE_POOL_SIZE-1; ++i) {
-		if(TEST_VAILD_PTR(S->services[i]) &&
-				0 == strcmp(S->services[i]->name, sname)) {
-			handle = i;
-			break;
+	/* 无锁读取当前快照，并发的注册或注销会通过epoch释放旧快照 */
+	epoch_enter();
+	HANDLE handle = inner_name_index_query(ATOM_LOAD_ACQ(&S->names), sname);
+	epoch_leave();
+
+	return handle;
+}
+
+int service_register_alias(HANDLE service_handle, const char *alias) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK_VAILD_PTR(alias);
+	int errcode = ERROR_FAILD;
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s)) {
+		char *name = strdup(alias);
+		if(TEST_VAILD_PTR(name)) {
+			errcode = inner_name_index_update(name, service_handle);
+			if(TEST_SUCCESS(errcode)) {
+				SPIN_LOCK(S);
+				ARRAY_PUSH_BACK(s->alias, char *, name);
+				SPIN_UNLOCK(S);
+			} else {
+				FREE(name);
+			}
 		}
 	}
 
-	SPIN_UNLOCK(S);
-
-	return handle;
+	return errcode;
 }
 
 logger *service_get_logger(HANDLE service_handle) {
 	CHECK_VAILD_SERVICE_HANDLE(service_handle);
-	SPIN_LOCK(S);
+	epoch_enter();
 	logger *log = NULL;
-	service *s = S->services[service_handle];
+	service *s = inner_service_get(service_handle);
 	if(TEST_VAILD_PTR(s)) {
 		log = s->log;
 	}
-	SPIN_UNLOCK(S);
+	epoch_leave();
 
 	return log;
 }
@@ -714,259 +1637,654 @@ uint32_t service_get_harborid(HANDLE handle) {
 	return HARBOR_ID(context_get_nodeid(), handle);
 }
 
-/* *
- * timeout_s < 0 : 永久等待
- * timeout_s == 0 : 即刻返回
- * timeout_s > 0 : 超时等待
- * */
-int service_wait(const char *sname, STAGE_TYPE type,
-		service_state state, double timeout_s) {
-	CHECK_VAILD_PTR(S);
-	CHECK_VAILD_PTR(sname);
-
-	timestamp last = timestamp_now();
-	HANDLE handle = INVAILD_SERVICE_HANDLE;
-
-	while(true) {
-		handle = service_get_handle(sname);
-
+/* 所有服务都已注册并到达指定阶段 */
+static bool inner_service_reach(const char **snames, int size,
+		STAGE_TYPE type, service_state state) {
+	bool ok = true;
+	epoch_enter();
+	for(int i=0; ok && i<size; ++i) {
+		service *s = NULL;
+		HANDLE handle = service_get_handle(snames[i]);
 		if(TEST_VAILD_SERVICE_HANDLE(handle)) {
-			break;
+			s = inner_service_get(handle);
 		}
 
-		timestamp now = timestamp_now();
-		double diff = timestamp_diff(now, last);
-
-		if(timeout_s >= 0 && diff > timeout_s) {
-			return ERROR_FAILD;
-		}
-
-		int errcode = thread_yield();
-		if(!TEST_SUCCESS(errcode)) {
-			fprintf(stderr, "thread_yield faild!\n");
+		if(!TEST_VAILD_PTR(s)) {
+			ok = false;
+			break;
 		}
-	}
 
-	CHECK(INVAILD_SERVICE_HANDLE != handle);
-	CHECK_VAILD_PTR(S->services[handle]);
-
-	while(true) {
-		bool ok = false;
+		service_state current = ATOM_LOAD_ACQ(&s->state);
 		switch(type) {
 		case STAGE_EQUAL :
-			ok = TEST_STAGE(S->services[handle]->state, state);
+			ok = TEST_STAGE(current, state);
 			break;
 		case STAGE_AFTER	 :
-			ok = TEST_STAGE_AFTER(S->services[handle]->state, state);
+			ok = TEST_STAGE_AFTER(current, state);
 			break;
 		case STAGE_SINCE	 :
-			ok = TEST_STAGE_SINCE(S->services[handle]->state, state);
+			ok = TEST_STAGE_SINCE(current, state);
 			break;
 		case STAGE_BEFORE :
-			ok = TEST_STAGE_BEFORE(S->services[handle]->state, state);
+			ok = TEST_STAGE_BEFORE(current, state);
 			break;
 		case STAGE_UNTIL :
-			ok = TEST_STAGE_UNTIL(S->services[handle]->state, state);
+			ok = TEST_STAGE_UNTIL(current, state);
 			break;
 		default:
-			return ERROR_FAILD;
-		}
-
-		if(ok) {
+			ok = false;
 			break;
 		}
+	}
+	epoch_leave();
 
-		timestamp now = timestamp_now();
-		double diff = timestamp_diff(now, last);
+	return ok;
+}
 
-		if(timeout_s >= 0 && diff > timeout_s)
-			return ERROR_FAILD;
+/* *
+ * 在state_ec上睡眠，直到条件满足或者超时
+ * 先登记再检查条件，检查之后的状态变化一定会唤醒本线程
+ * */
+static int inner_service_wait(const char **snames, int size,
+		STAGE_TYPE type, service_state state, double timeout_s) {
+	timestamp last = timestamp_now();
 
-		int errcode = thread_yield();
-		if(!TEST_SUCCESS(errcode)) {
-			fprintf(stderr, "thread_yield faild!\n");
+	while(true) {
+		int key = eventcount_prepare(&S->state_ec);
+		if(inner_service_reach(snames, size, type, state)) {
+			eventcount_cancel(&S->state_ec);
+			return ERROR_SUCCESS;
+		}
+
+		double remain = -1;
+		if(timeout_s >= 0) {
+			remain = timeout_s - timestamp_diff(timestamp_now(), last);
+			if(remain <= 0) {
+				eventcount_cancel(&S->state_ec);
+				return ERROR_FAILD;
+			}
 		}
+
+		eventcount_wait(&S->state_ec, key, remain);
 	}
+}
 
-	return ERROR_SUCCESS;
+/* *
+ * timeout_s < 0 : 永久等待
+ * timeout_s == 0 : 即刻返回
+ * timeout_s > 0 : 超时等待
+ * */
+int service_wait(const char *sname, STAGE_TYPE type,
+		service_state state, double timeout_s) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_PTR(sname);
+	if(type < STAGE_EQUAL || type > STAGE_UNTIL)
+		return ERROR_FAILD;
+
+	return inner_service_wait(&sname, 1, type, state, timeout_s);
 }
 
 int service_batch_wait(const char **snames, STAGE_TYPE type,
 		service_state state, double timeout_s) {
 	CHECK_VAILD_PTR(S);
 	CHECK_VAILD_PTR(snames);
-
-	timestamp last = timestamp_now();
-	HANDLE handle = INVAILD_SERVICE_HANDLE;
+	if(type < STAGE_EQUAL || type > STAGE_UNTIL)
+		return ERROR_FAILD;
 
 	int size = 0;
 	while(TEST_VAILD_PTR(snames[size])) {
 		++ size;
 	}
 
-	while(true) {
-		const char *sname = NULL;
-		int counter = 0;
-		for(int i=0; i<size; ++i) {
-			sname = snames[i];
-			handle = service_get_handle(sname);
-			if(TEST_VAILD_SERVICE_HANDLE(handle)) {
-				++ counter;
-			}
-		}
+	return inner_service_wait(snames, size, type, state, timeout_s);
+}
 
-		if(counter == size) {
-			break;
-		}
+bool service_push_message(HANDLE service_handle, message *msg) {
+	CHECK_VAILD_PTR(msg);
+	epoch_enter();
+	service *s = inner_service_get(service_handle);
 
-		timestamp now = timestamp_now();
-		double diff = timestamp_diff(now, last);
+	if(!TEST_VAILD_PTR(s)) {
+		epoch_leave();
+		context_send_mail(INVAILD_SERVICE_HANDLE, msg);
+		return false;
+	}
 
-		if(timeout_s >= 0 && diff > timeout_s) {
-			return ERROR_FAILD;
+	service_type type = s->type;
+	epoch_leave();
+
+	switch(type) {
+	case TYPE_SERVICE:
+	case TYPE_SERVLET:
+		context_send_mail(service_handle, msg);
+		return true;
+	default :
+		fprintf(stderr, "push service type (%d) error!", type);
+		message_free(msg);
+	}
+
+	return false;
+}
+
+int service_list(HANDLE from, service_type type, HANDLE handles[], int max) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_PTR(handles);
+	CHECK(type >= TYPE_SERVICE && type <= TYPE_SERVLET);
+	int count = 0;
+	epoch_enter();
+	for(int i=MAX(from, 0); i<INVAILD_SERVICE_HANDLE && count < max; ++i) {
+		service *s = inner_service_get(i);
+		if(TEST_VAILD_PTR(s) && type == s->type) {
+			handles[count ++] = s->handle;
 		}
+	}
+	epoch_leave();
 
-		int errcode = thread_yield();
-		if(!TEST_SUCCESS(errcode)) {
-			fprintf(stderr, "thread_yield faild!\n");
+	return count;
+}
+
+void service_push_messages(HANDLE service_handle, message *msgs[], int n) {
+	CHECK_VAILD_PTR(msgs);
+	if(n <= 0)
+		return;
+
+	epoch_enter();
+	service *s = inner_service_get(service_handle);
+	service_type type = TEST_VAILD_PTR(s) ? s->type : TYPE_SERVICE;
+	epoch_leave();
+
+	if(!TEST_VAILD_PTR(s)) {
+		context_send_mails(INVAILD_SERVICE_HANDLE, msgs, n);
+		return;
+	}
+
+	switch(type) {
+	case TYPE_SERVICE:
+	case TYPE_SERVLET:
+		context_send_mails(service_handle, msgs, n);
+		inner_flow_check_high(service_handle);
+		break;
+	default :
+		fprintf(stderr, "push service type (%d) error!", type);
+		for(int i=0; i<n; ++i) {
+			message_free(msgs[i]);
 		}
 	}
+}
 
-	while(true) {
-		bool ok = true;
-		const char *sname = NULL;
-		for(int i=0; i<size; ++i) {
-			sname = snames[i];
-			handle = service_get_handle(sname);
-			CHECK_VAILD_SERVICE_HANDLE(handle);
-			switch(type) {
-			case STAGE_EQUAL :
-				ok &= TEST_STAGE(S->services[handle]->state, state);
-				break;
-			case STAGE_AFTER	 :
-				ok &= TEST_STAGE_AFTER(S->services[handle]->state, state);
-				break;
-			case STAGE_SINCE	 :
-				ok &= TEST_STAGE_SINCE(S->services[handle]->state, state);
-				break;
-			case STAGE_BEFORE :
-				ok &= TEST_STAGE_BEFORE(S->services[handle]->state, state);
-				break;
-			case STAGE_UNTIL :
-				ok &= TEST_STAGE_UNTIL(S->services[handle]->state, state);
-				break;
-			default:
-				return ERROR_FAILD;
+/* 当前调度的服务开启了协程模式时返回该服务 */
+static inline service *inner_co_self(HANDLE service_handle) {
+	service *s = t_selfService;
+	if(TEST_VAILD_PTR(s) && s->handle == service_handle && TEST_VAILD_PTR(s->co))
+		return s;
+
+	return NULL;
+}
+
+/* msg是某个挂起协程等待的应答时，交给该协程并放入就绪链表 */
+static bool inner_co_intercept(service *s, message *msg) {
+	co_table *table = s->co;
+	if(0 == msg->session || MSG_IS_REQ(msg) || 0 == table->waiting)
+		return false;
+
+	co_waiter **pptr = &table->buckets[(uint32_t)msg->session & (CO_WAIT_BUCKETS - 1)];
+	while(TEST_VAILD_PTR(*pptr)) {
+		co_waiter *waiter = *pptr;
+		if(waiter->session == msg->session) {
+			*pptr = waiter->next;
+			-- table->waiting;
+			waiter->reply = msg;
+			NUL(waiter->next);
+			if(TEST_VAILD_PTR(table->ready_tail)) {
+				table->ready_tail->next = waiter;
+			} else {
+				table->ready_head = waiter;
 			}
+			table->ready_tail = waiter;
+			return true;
 		}
+		pptr = &waiter->next;
+	}
+
+	return false;
+}
+
+bool service_can_await() {
+	return TEST_VAILD_PTR(t_selfService) && TEST_VAILD_PTR(t_selfService->co) &&
+			TEST_VAILD_PTR(coroutine_current());
+}
+
+message *service_await_reply(int session) {
+	if(!service_can_await())
+		return NULL;
+
+	co_table *table = t_selfService->co;
+	co_waiter waiter;
+	waiter.session = session;
+	waiter.co = coroutine_current();
+	NUL(waiter.reply);
+	co_waiter **head = &table->buckets[(uint32_t)session & (CO_WAIT_BUCKETS - 1)];
+	waiter.next = *head;
+	*head = &waiter;
+	++ table->waiting;
+
+	/* 恢复时可能已经在另一个worker线程中，之后不再访问线程局部变量 */
+	coroutine_yield();
+
+	return waiter.reply;
+}
+
+int service_enable_coroutine(HANDLE service_handle) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	int errcode = ERROR_FAILD;
+	MALLOC_DEF(table, co_table);
+	if(!TEST_VAILD_PTR(table))
+		return errcode;
+	STRUCT_ZERO(table);
+
+	SPIN_LOCK(S);
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s) && TYPE_SERVLET == s->type && !TEST_VAILD_PTR(s->co)) {
+		s->co = table;
+		NUL(table);
+		errcode = ERROR_SUCCESS;
+	}
+	SPIN_UNLOCK(S);
+
+	if(TEST_VAILD_PTR(table)) {
+		FREE(table);
+	}
+	return errcode;
+}
+
+message *service_pop_message(HANDLE service_handle) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	epoch_enter();
+	service *s = inner_service_get(service_handle);
+	CHECK_VAILD_PTR(s);
+	service_type type = s->type;
+	epoch_leave();
+
+	CHECK(type >= TYPE_SERVICE && type <= TYPE_SERVLET);
+	message *msg = NULL;
+	service *self = inner_co_self(service_handle);
+	bool intercepted = false;
 
-		if(ok) {
+	for(;;) {
+		switch(type) {
+		case TYPE_SERVICE:
+			/* worker线程不可以阻塞 */
+			msg = context_try_recv_mail(service_handle);
+			break;
+		case TYPE_SERVLET:
+			/* 可能会阻塞，协程模式下等待应答的协程依赖本次调度恢复，不能阻塞 */
+			msg = TEST_VAILD_PTR(self) ? context_try_recv_mail(service_handle) :
+					context_recv_mail(service_handle);
+			break;
+		default:
+			fprintf(stderr, "pop service type (%d) error!", type);
 			break;
 		}
+		/* 被截获的应答交给等待的协程，同样计入预算 */
+		if(!TEST_VAILD_PTR(msg) || !TEST_VAILD_PTR(self) || !inner_co_intercept(self, msg))
+			break;
+		if(t_msgBudget > 0) {
+			-- t_msgBudget;
+		}
+		intercepted = true;
+	}
 
-		timestamp now = timestamp_now();
-		double diff = timestamp_diff(now, last);
+	if(TEST_VAILD_PTR(msg)) {
+		if(t_msgBudget > 0) {
+			-- t_msgBudget;
+		}
+	}
+	if(TEST_VAILD_PTR(msg) || intercepted) {
+		inner_flow_check_low(service_handle);
+	}
 
-		if(timeout_s >= 0 && diff > timeout_s)
-			return ERROR_FAILD;
+	return msg;
+}
 
-		int errcode = thread_yield();
-		if(!TEST_SUCCESS(errcode)) {
-			fprintf(stderr, "thread_yield faild!\n");
+/* 非阻塞批量取消息，servlet在一次调度中可以一次处理一批消息 */
+int service_pop_messages(HANDLE service_handle, message *msgs[], int max) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK_VAILD_PTR(msgs);
+	if(t_msgBudget >= 0) {
+		max = MIN(max, t_msgBudget);
+	}
+
+	int count = 0;
+	if(max > 0) {
+		count = context_try_recv_mails(service_handle, msgs, max);
+		if(t_msgBudget > 0) {
+			t_msgBudget -= count;
+		}
+		if(count > 0) {
+			inner_flow_check_low(service_handle);
+		}
+		/* 协程模式下取出被截获的应答，剩余消息保持顺序 */
+		service *self = inner_co_self(service_handle);
+		if(TEST_VAILD_PTR(self)) {
+			int kept = 0;
+			for(int i=0; i<count; ++i) {
+				if(!inner_co_intercept(self, msgs[i])) {
+					msgs[kept ++] = msgs[i];
+				}
+			}
+			count = kept;
 		}
 	}
 
-	return ERROR_SUCCESS;
+	return count;
 }
 
-void service_push_message(HANDLE service_handle, message *msg) {
-	CHECK_VAILD_PTR(msg);
+void service_set_dispatch_budget(HANDLE service_handle, int msgs, double seconds) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK(msgs > 0);
 	SPIN_LOCK(S);
-	service *s = S->services[service_handle];
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s)) {
+		s->budget_msgs = msgs;
+		s->budget_time = seconds;
+	}
 	SPIN_UNLOCK(S);
+}
 
-	if(!TEST_VAILD_PTR(s)) {
-		context_send_mail(INVAILD_SERVICE_HANDLE, msg);
-		return;
+void service_set_watermark(HANDLE service_handle, int high, int low) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK(high >= 0 && low >= 0 && (0 == high || low < high));
+	bool resume = false;
+	SPIN_LOCK(S);
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s)) {
+		s->high_water = high;
+		s->low_water = low;
+		/* 关闭流控或者已经低于新的低水位时立即恢复 */
+		resume = atomic_get(&s->throttled) &&
+				(0 == high || context_get_mail_depth(service_handle) <= (size_t)low) &&
+				atomic_cas(&s->throttled, true, false);
+	}
+	SPIN_UNLOCK(S);
+
+	if(resume) {
+		inner_flow_post(service_handle);
 	}
+}
 
-	switch(s->type) {
-	case TYPE_SERVICE:
-	case TYPE_SERVLET:
-		context_send_mail(service_handle, msg);
-		break;
-	default :
-		fprintf(stderr, "push service type (%d) error!", s->type);
-		FREE(msg);
+void service_set_codel(HANDLE service_handle, double target, double interval) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK(target >= 0 && interval >= 0);
+	epoch_enter();
+	if(TEST_VAILD_PTR(inner_service_get(service_handle))) {
+		context_set_mailbox_codel(service_handle, target, interval);
 	}
+	epoch_leave();
 }
 
-message *service_pop_message(HANDLE service_handle) {
+void service_get_codel_stat(HANDLE service_handle, service_codel_stat *stat) {
 	CHECK_VAILD_PTR(S);
 	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK_VAILD_PTR(stat);
+	STRUCT_ZERO(stat);
+	epoch_enter();
+	if(TEST_VAILD_PTR(inner_service_get(service_handle))) {
+		context_get_mailbox_codel(service_handle, &stat->target, &stat->interval, &stat->drops);
+	}
+	epoch_leave();
+}
+
+void service_set_weight(HANDLE service_handle, int weight) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK(weight >= 1 && weight <= SERVICE_WEIGHT_MAX);
 	SPIN_LOCK(S);
-	service *s = S->services[service_handle];
-	CHECK_VAILD_PTR(s);
-	service_type type = s->type;
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s)) {
+		s->weight = weight;
+	}
 	SPIN_UNLOCK(S);
+}
 
-	CHECK(type >= TYPE_SERVICE && type <= TYPE_SERVLET);
-	message *msg = NULL;
+static void inner_service_sched_stat(service *s, service_sched_stat *stat) {
+	stat->weight = s->weight;
+	stat->activations = ATOM_LOAD_ACQ(&s->activations);
+	stat->skips = ATOM_LOAD_ACQ(&s->skips);
+	stat->run_time = (double)ATOM_LOAD_ACQ(&s->run_us) / MICRO_SECOND_PER_SECOND;
+	stat->max_slice = (double)ATOM_LOAD_ACQ(&s->max_slice_us) / MICRO_SECOND_PER_SECOND;
+}
 
-	switch(type) {
-	case TYPE_SERVICE:
-		/* worker线程不可以阻塞 */
-		msg = context_try_recv_mail(service_handle);
-		break;
-	case TYPE_SERVLET:
-		/* 可能会阻塞 */
-		msg = context_recv_mail(service_handle);
-		break;
-	default:
-		fprintf(stderr, "pop service type (%d) error!", s->type);
-		break;
+void service_get_sched_stat(HANDLE service_handle, service_sched_stat *stat) {
+	CHECK_VAILD_PTR(S);
+	CHECK_VAILD_SERVICE_HANDLE(service_handle);
+	CHECK_VAILD_PTR(stat);
+	STRUCT_ZERO(stat);
+	epoch_enter();
+	service *s = inner_service_get(service_handle);
+	if(TEST_VAILD_PTR(s)) {
+		inner_service_sched_stat(s, stat);
 	}
+	epoch_leave();
+}
 
-	return msg;
+void service_sched_report() {
+	CHECK_VAILD_PTR(S);
+	uint64_t total_us = 0;
+	epoch_enter();
+	for(int i=0; i<INVAILD_SERVICE_HANDLE; ++i) {
+		service *s = inner_service_get(i);
+		if(TEST_VAILD_PTR(s) && TYPE_SERVLET == s->type) {
+			total_us += ATOM_LOAD_ACQ(&s->run_us);
+		}
+	}
+
+	printf("servlet schedule report : total run %.3f ms\n", (double)total_us / 1000);
+	printf("  %-16s %6s %10s %10s %12s %7s %10s\n",
+			"service", "weight", "runs", "skips", "run(ms)", "share", "max(us)");
+	for(int i=0; i<INVAILD_SERVICE_HANDLE; ++i) {
+		service *s = inner_service_get(i);
+		if(!TEST_VAILD_PTR(s) || TYPE_SERVLET != s->type)
+			continue;
+		service_sched_stat stat;
+		inner_service_sched_stat(s, &stat);
+		printf("  %-16s %6d %10" PRIu64 " %10" PRIu64 " %12.3f %6.1f%% %10.0f\n",
+				s->name, stat.weight, stat.activations, stat.skips, stat.run_time * 1000,
+				total_us ? stat.run_time * MICRO_SECOND_PER_SECOND * 100 / total_us : 0.0,
+				stat.max_slice * MICRO_SECOND_PER_SECOND);
+	}
+	epoch_leave();
 }
 
 void service_handle_trash() {
 	CHECK_VAILD_PTR(S);
+	/* 主线程顺带回收已撤下的服务表项 */
+	(void)epoch_reclaim();
 	message *msg = context_try_recv_mail(INVAILD_SERVICE_HANDLE);
 	/* 注意：不能转为msg后再判断指针的有效性，node为NULL，msg不为NULL */
-	if(TEST_VAILD_PTR(msg)) {
+	while(TEST_VAILD_PTR(msg)) {
 		if(TEST_VAILD_PTR(msg->data)) {
-			FREE(msg->data);
+			message_free_data(msg);
 		}
-		FREE(msg);
+		message_free(msg);
+		msg = context_try_recv_mail(INVAILD_SERVICE_HANDLE);
+	}
+}
+
+typedef struct co_start_args {
+	module *mod;
+	HANDLE handle;
+	co_table *table;
+} co_start_args;
+
+static void inner_co_start_entry(void *args) {
+	/* 第一次resume时同步执行，之后args所在的栈帧可能已经不存在 */
+	co_start_args start = *(co_start_args *)args;
+	int errcode = module_signal(start.mod, start.handle, SIG_SERVICE_START);
+	start.table->errcode = errcode;
+}
+
+/* 依次恢复应答已经到达的协程，恢复过程中截获的新应答也在本轮处理 */
+static void inner_co_resume_ready(co_table *table) {
+	while(TEST_VAILD_PTR(table->ready_head)) {
+		co_waiter *waiter = table->ready_head;
+		table->ready_head = waiter->next;
+		if(!TEST_VAILD_PTR(table->ready_head)) {
+			NUL(table->ready_tail);
+		}
+		/* waiter在协程栈上，恢复之后不能再访问 */
+		coroutine *co = waiter->co;
+		if(COROUTINE_DEAD == coroutine_resume(co)) {
+			coroutine_destroy(co);
+		}
+	}
+}
+
+/* 执行一次SIG_SERVICE_START，协程模式下在新协程中执行，挂起的协程留待应答到达 */
+static int inner_service_run(module *mod, service *s) {
+	co_table *table = s->co;
+	if(!TEST_VAILD_PTR(table))
+		return inner_service_signal(mod, s->handle, SIG_SERVICE_START);
+
+	int errcode = ERROR_SUCCESS;
+	inner_servicethread_init(s->handle);
+	co_start_args args;
+	args.mod = mod;
+	args.handle = s->handle;
+	args.table = table;
+	coroutine *co = coroutine_create(inner_co_start_entry, &args);
+	if(TEST_VAILD_PTR(co)) {
+		if(COROUTINE_DEAD == coroutine_resume(co)) {
+			errcode = table->errcode;
+			coroutine_destroy(co);
+		}
+	} else {
+		/* 分配不到协程时直接在worker栈上执行，其中的qcall_await会失败 */
+		errcode = module_signal(mod, s->handle, SIG_SERVICE_START);
 	}
+	inner_co_resume_ready(table);
+	inner_servicethread_release();
+
+	return errcode;
 }
 
 static void *inner_dispatch_routine(void *input, int *errcode) {
-	int handle = *(HANDLE *)input;
-	printf("dispatch message service handle is %d\n", handle);
+	service *s = (service *)input;
+	CHECK_VAILD_PTR(s);
+	HANDLE handle = s->handle;
 	CHECK_VAILD_SERVICE_HANDLE(handle);
-	module *mod = service_get_module(handle);
+	*errcode = ERROR_SUCCESS;
+	/* task持有s的引用；排队期间服务已经注销时邮箱也已销毁，只交还引用 */
+	epoch_enter();
+	bool alive = (inner_service_get(handle) == s);
+	epoch_leave();
+	if(!alive) {
+		inner_service_unref(s);
+		return NULL;
+	}
+
+	module *mod = inner_service_module(s);
 	CHECK_VAILD_PTR(mod);
 	*errcode = ERROR_FAILD;
+	context_run_ready(handle);
 	if(TEST_VAILD_PTR(mod)) {
-		*errcode = inner_service_signal(mod, handle, SIG_SERVICE_START);
+		/* 调度期间task持有s的引用，预算和权重只在对应的设置函数中整体更新 */
+		int weight = s->weight;
+		int budget_msgs = MAX(s->budget_msgs * weight / SERVICE_WEIGHT_DEFAULT, 1);
+		int64_t quantum = (int64_t)(s->budget_time * MICRO_SECOND_PER_SECOND) * weight / SERVICE_WEIGHT_DEFAULT;
+
+		/* *
+		 * DRR：每次调度补充一个时间片，上次超用的部分从本次扣除，剩余额度不累积
+		 * 单条消息处理时间超过时间片的服务会连续让出几轮，整体占用与权重成正比
+		 * 没有其他任务在等待时让出只会空转一趟，免除欠账直接运行
+		 * */
+		int64_t credit = MIN(s->credit + quantum, quantum);
+		if(credit <= 0 && !threadpool_has_pending()) {
+			credit = quantum;
+		}
+		if(credit > 0) {
+			/* 一次调度连续处理消息，直到消息数或时间预算用完 */
+			timestamp begin = timestamp_now();
+			int64_t used = 0;
+			t_msgBudget = budget_msgs;
+			do {
+				int remain = t_msgBudget;
+				*errcode = inner_service_run(mod, s);
+				used = timestamp_now().us - begin.us;
+				if(!TEST_SUCCESS(*errcode) || remain == t_msgBudget) {
+					/* 出错或者本次没有取走任何消息 */
+					break;
+				}
+			} while(t_msgBudget > 0 && context_has_mail(handle) && used < credit);
+			t_msgBudget = -1;
+
+			s->credit = credit - used;
+			ATOM_STORE_REL(&s->run_us, s->run_us + used);
+			ATOM_STORE_REL(&s->activations, s->activations + 1);
+			if((uint64_t)used > s->max_slice_us) {
+				ATOM_STORE_REL(&s->max_slice_us, used);
+			}
+		} else {
+			/* 额度不足，本轮让给其他服务 */
+			s->credit = credit;
+			*errcode = ERROR_SUCCESS;
+			ATOM_STORE_REL(&s->skips, s->skips + 1);
+		}
+	}
+
+	/* *
+	 * 本次调度结束，仍有消息时由worker直接重新提交，引用转交给新提交的task
+	 * 任务队列满时交给主线程，由主线程重新取得引用
+	 * */
+	bool requeued = false;
+	if(context_finish_ready(handle)) {
+		requeued = TEST_SUCCESS(threadpool_try_submit(&s->task));
+		if(!requeued) {
+			context_post_ready(handle);
+		}
+	}
+	/* 重新提交之后task可能已经在其他worker上运行，不能再访问s */
+	if(!requeued) {
+		inner_service_unref(s);
 	}
 
 	return NULL;
 }
 
+/* *
+ * 没有就绪服务时主线程最多睡眠的时间(秒)，只为了定期执行monitor和epoch回收
+ * 新的就绪服务和trash邮件都会直接唤醒主线程，不依赖这个周期
+ * */
+#define DISPATCH_IDLE_TIMEOUT	0.1
+
 void service_dispatch_message() {
+	CHECK_VAILD_PTR(S);
 	service *s = NULL;
-	threadpool_task *task;
-
-	for(int i=0; i<SERVICE_POOL_SIZE-1; ++i) {
-		s = S->services[i];
-
-		if(TEST_VAILD_PTR(s) && TYPE_SERVLET == s->type && context_has_mail(i)) {
-			task = threadpool_task_create(inner_dispatch_routine, &s->handle, NULL);
-			threadpool_submit(task);
+	/* 只有第一次等待，之后把已就绪的handle全部取完 */
+	HANDLE handle = context_wait_ready(DISPATCH_IDLE_TIMEOUT);
+
+	while(TEST_VAILD_SERVICE_HANDLE(handle)) {
+		epoch_enter();
+		s = inner_service_get(handle);
+		bool acquired = TEST_VAILD_PTR(s) && TYPE_SERVLET == s->type && inner_service_ref(s);
+		epoch_leave();
+
+		if(acquired) {
+			/* 使用service内嵌的task，不需要分配内存，引用随task交给worker */
+			if(!TEST_SUCCESS(threadpool_submit(&s->task))) {
+				context_reset_ready(handle);
+				inner_service_unref(s);
+			}
+		} else {
+			/* service类型自己收取消息 */
+			context_reset_ready(handle);
 		}
-	}
 
+		handle = context_wait_ready(0);
+	}
 }
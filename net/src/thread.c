@@ -5,10 +5,14 @@
  *      Author: linzer
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
 #include <unistd.h>
 #include <sys/syscall.h>
 #ifdef __linux__
 #include <sys/sysinfo.h>
+#include <sched.h>
 #endif
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,38 +33,41 @@ typedef struct thread{
 	char name[MAX_THREAD_NAME+1];
 	thread_entry entry;
 	int handle;
+	int cpu;				/* 绑定的cpu，-1表示不绑定 */
 	spinlock lock;
 } thread;
 
 typedef struct threadpool{
-	ARRAY threads;
+	ARRAY threads;				/* thread *，运行中的线程持有自己的指针，不能随数组扩容移动 */
 	threadpool_limit limit;
 	spinlock lock;
-	bound_block_queue *queue;
+	bound_block_queue *queue;	/* 全局队列，接收非worker线程提交的任务 */
+	ws_deque **deques;			/* worker本地队列，按worker启动顺序编号 */
+	int ndeque;					/* deques容量 */
+	atomic_t nworker_deque;		/* 已注册的本地队列数 */
+	eventcount idle;				/* 空闲worker在此睡眠 */
+	uint64_t steals;
 	int worker;
 	int service;
+	int ncpu;					/* 可用cpu数 */
+	int *cpus;					/* 可用cpu编号，按亲和性掩码升序 */
+	atomic_t bound_worker;		/* 已绑定cpu的worker数 */
+	atomic_t bound_loop;			/* 已绑定cpu的loop线程数 */
 	atomic_t running;			/* bool */
 } threadpool;
 
-typedef struct threadpool_task{
-	task_routine routine;
-	task_done done;
-	void *input;
-	void *result;
-	int errcode;
-	queue_node node;
-} threadpool_task;
-
 static atomic_t g_threadCounter = { 0 }; /* 该原子变量只是用来生成线程默认名称 */
 __thread static int t_cachedTid = 0;
 __thread static char t_tidString[32];
 __thread static const char* t_threadName = "unknown";
 __thread static thread *t_thread = NULL;
+__thread static ws_deque *t_deque = NULL;		/* 当前worker的本地队列 */
+__thread static uint32_t t_stealSeed = 0;
 static int g_mainThreadid = 0;
 static atomic_t g_genThreadID = { 0 };
 
-/* OSX 废弃了syscall接口，gettid始终返回-1 */
-static inline int gettid() {
+/* OSX 废弃了syscall接口，gettid始终返回-1；glibc在_GNU_SOURCE下自带gettid，不能同名 */
+static inline int inner_gettid() {
 #ifdef __linux__
 	return (pid_t)syscall(SYS_gettid);
 #else
@@ -70,7 +77,7 @@ static inline int gettid() {
 
 static inline void cache_tid() {
 	if (t_cachedTid == 0) {
-		t_cachedTid = gettid();
+		t_cachedTid = inner_gettid();
 		snprintf(t_tidString, sizeof(t_tidString), "%5d ", t_cachedTid);
 		// printf("g_cachedTid : %ul\n", (unsigned int)g_cachedTid);
 	}
@@ -108,6 +115,7 @@ static inline void thread_reset_info(thread *t) {
 	t->pthreadId = INVAILD_THREAD_ID;
 	t->tid = INVAILD_THREAD_ID;
 	t->handle = INVAILD_THREAD_HANDLE;
+	t->cpu = -1;
 	t->type = INVAILD_THREAD_TYPE;
 	t->name[0] = '\0';
 }
@@ -268,6 +276,10 @@ void threadpool_limit_init(threadpool_limit *limit) {
 	limit->worker = INVAILD_LIMIT;
 	limit->service = NO_LIMIT;
 	limit->task = INVAILD_LIMIT;
+	limit->loop = INVAILD_LIMIT;
+	limit->pin_worker = false;
+	limit->pin_loop = false;
+	idle_strategy_init(&limit->idle, IDLE_SPIN_DEFAULT, IDLE_YIELD_DEFAULT);
 }
 
 void threadpool_limit_worker(threadpool_limit *limit, int num) {
@@ -287,10 +299,28 @@ void threadpool_limit_task(threadpool_limit *limit, int num) {
 	limit->task = num;
 }
 
+void threadpool_limit_loop(threadpool_limit *limit, int num) {
+	assert(limit != NULL);
+	assert(num >= 0);
+	limit->loop = num;
+}
+
+void threadpool_limit_affinity(threadpool_limit *limit, bool pin_worker, bool pin_loop) {
+	assert(limit != NULL);
+	limit->pin_worker = pin_worker;
+	limit->pin_loop = pin_loop;
+}
+
+void threadpool_limit_idle(threadpool_limit *limit, int spin, int yield) {
+	assert(limit != NULL);
+	idle_strategy_init(&limit->idle, spin, yield);
+}
+
 
 #define DEFAULT_SERVICE_THREAD_NUM	NO_LIMIT
-#define DEFAULT_WORKER_THREAD_NUM	4
+#define DEFAULT_WORKER_THREAD_NUM	4		/* 无法获取cpu数时使用 */
 #define DEFAULT_TASKQUEUE_NUM		1024
+#define DEFAULT_LOOP_THREAD_NUM		1
 
 threadpool_task *threadpool_task_create(task_routine routine, void *input, task_done done) {
 	threadpool_task *task = (threadpool_task *)malloc(sizeof(threadpool_task));
@@ -300,13 +330,105 @@ threadpool_task *threadpool_task_create(task_routine routine, void *input, task_
 		task->input = input;
 		task->errcode = ERROR_SUCCESS;
 		task->result = NULL;
+		task->embedded = false;
 	}
 
 	return task;
 }
 
+void threadpool_task_init(threadpool_task *task, task_routine routine, void *input, task_done done) {
+	CHECK_VAILD_PTR(task);
+	task->routine = routine;
+	task->done = done;
+	task->input = input;
+	task->errcode = ERROR_SUCCESS;
+	task->result = NULL;
+	task->embedded = true;
+}
+
 static threadpool *P = NULL;
-static threadpool_limit DEFAULT_LIMIT = { DEFAULT_SERVICE_THREAD_NUM, DEFAULT_WORKER_THREAD_NUM, DEFAULT_TASKQUEUE_NUM };
+
+/* 调用者持有锁或在初始化阶段 */
+static thread *inner_thread_alloc(threadpool *pool) {
+	MALLOC_DEF(t, thread);
+	if(TEST_VAILD_PTR(t)) {
+		ARRAY_PUSH_BACK(pool->threads, thread *, t);
+	}
+
+	return t;
+}
+static threadpool_limit DEFAULT_LIMIT = {
+	.worker = INVAILD_LIMIT,
+	.service = DEFAULT_SERVICE_THREAD_NUM,
+	.task = DEFAULT_TASKQUEUE_NUM,
+	.loop = DEFAULT_LOOP_THREAD_NUM,
+	.pin_worker = false,
+	.pin_loop = false,
+	.idle = { IDLE_SPIN_DEFAULT, IDLE_YIELD_DEFAULT },
+};
+
+static inline int inner_online_cpus() {
+#ifdef __linux__
+	return get_nprocs();
+#else
+	long num = sysconf(_SC_NPROCESSORS_ONLN);
+	return num > 0 ? (int)num : DEFAULT_WORKER_THREAD_NUM;
+#endif
+}
+
+/* *
+ * 进程可以使用的cpu编号，失败返回0
+ * 在taskset或cgroup cpuset下编号不连续，也不一定从0开始，绑定时按下标取编号
+ * */
+static int inner_usable_cpus(int **cpus) {
+	int ncpu = 0;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if(0 == sched_getaffinity(0, sizeof set, &set) && CPU_COUNT(&set) > 0) {
+		*cpus = (int *)malloc(CPU_COUNT(&set) * sizeof(int));
+		if(TEST_VAILD_PTR(*cpus)) {
+			for(int cpu=0; cpu<CPU_SETSIZE; ++cpu) {
+				if(CPU_ISSET(cpu, &set)) {
+					(*cpus)[ncpu ++] = cpu;
+				}
+			}
+		}
+		return ncpu;
+	}
+#endif
+	int num = inner_online_cpus();
+	*cpus = (int *)malloc(num * sizeof(int));
+	if(TEST_VAILD_PTR(*cpus)) {
+		for(; ncpu<num; ++ncpu) {
+			(*cpus)[ncpu] = ncpu;
+		}
+	}
+
+	return ncpu;
+}
+
+/* 将当前线程绑定到cpu，不支持时返回ERROR_FAILD */
+static int inner_bind_cpu(thread *t, int cpu) {
+	int errcode = ERROR_FAILD;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if(0 == pthread_setaffinity_np(pthread_self(), sizeof set, &set)) {
+		errcode = ERROR_SUCCESS;
+	}
+#endif
+	if(TEST_SUCCESS(errcode) && TEST_VAILD_PTR(t)) {
+		SPIN_LOCK(t);
+		t->cpu = cpu;
+		SPIN_UNLOCK(t);
+	}
+	printf("thread %s(%d) %s cpu %d\n", thread_current_name(), thread_current_id(),
+			TEST_SUCCESS(errcode) ? "bound to" : "faild to bind", cpu);
+
+	return errcode;
+}
 /* thread pool */
 int threadpool_init(threadpool_limit *limit) {
 	int errcode = ERROR_FAILD;
@@ -321,12 +443,26 @@ int threadpool_init(threadpool_limit *limit) {
 	}
 
 	pool->limit.service = DEFAULT_SERVICE_THREAD_NUM;
+	pool->ncpu = inner_usable_cpus(&pool->cpus);
+	if(pool->ncpu <= 0) {
+		FREE(pool->cpus);
+		FREE(pool);
+		return errcode;
+	}
+
+	if(pool->limit.loop < 0)
+		pool->limit.loop = DEFAULT_LOOP_THREAD_NUM;
+
+	/* 单核上忙等只会占住生产者需要的cpu */
+	if(pool->ncpu <= 1)
+		pool->limit.idle.spin = 0;
+
+	/* 独占的cpu不能超过总数，至少留一个给worker */
+	if(pool->limit.pin_loop && pool->limit.loop >= pool->ncpu)
+		pool->limit.pin_loop = false;
 
 	if(pool->limit.worker <= 0) {
-#ifdef __linux__
-		pool->limit.worker = get_nprocs();
-#endif
-		pool->limit.worker = DEFAULT_WORKER_THREAD_NUM;
+		pool->limit.worker = MAX(pool->ncpu - pool->limit.loop, 1);
 	}
 
 	if(pool->limit.task <= 0)
@@ -334,28 +470,40 @@ int threadpool_init(threadpool_limit *limit) {
 
 	pool->service = 0;
 	pool->worker = 0;
+	atomic_set(&pool->bound_worker, 0);
+	atomic_set(&pool->bound_loop, 0);
+	atomic_set(&pool->nworker_deque, 0);
+	eventcount_init(&pool->idle);
+	pool->steals = 0;
 	SPIN_INIT(pool);
 	ARRAY_NEW(pool->threads);
-	if(TEST_VAILD_PTR(pool->threads)) {
+	/* 之后调大worker上限时，多出的worker只使用全局队列 */
+	pool->ndeque = pool->limit.worker;
+	pool->deques = (ws_deque **)calloc(pool->ndeque, sizeof(ws_deque *));
+	if(TEST_VAILD_PTR(pool->threads) && TEST_VAILD_PTR(pool->deques)) {
 		pool->queue = bound_block_queue_create(pool->limit.task);
 		if(TEST_VAILD_PTR(pool->queue)) {
 			ATOMIC_TRUE(pool->running);
 			P = pool;
 
 			/* 将main线程添加进thread pool */
-			thread *t = ARRAY_OFFSET(P->threads, thread, 1);
+			thread *t = inner_thread_alloc(P);
 			if(TEST_VAILD_PTR(t)) {
-				HANDLE handle = ARRAY_SIZE(P->threads, thread) - 1;
+				HANDLE handle = ARRAY_SIZE(P->threads, thread *) - 1;
 				thread_init(t, NULL, NULL, "dispatch", THREAD_MAIN, handle);
 			}
 
+			printf("threadpool: %d cpus, %d workers%s, %d loops%s\n", P->ncpu,
+					P->limit.worker, P->limit.pin_worker ? " pinned" : "",
+					P->limit.loop, P->limit.pin_loop ? " pinned" : "");
 			errcode = ERROR_SUCCESS;
 			return errcode;
 		}
-
-		ARRAY_DESTROY(pool->threads);
 	}
 
+	ARRAY_DESTROY(pool->threads);
+	FREE(pool->deques);
+	FREE(pool->cpus);
 	FREE(pool);
 
 	return errcode;
@@ -365,7 +513,9 @@ void free_task_node(queue_node *node) {
 	if(node) {
 		threadpool_task *task = DATA(node, threadpool_task, node);
 		assert(task != NULL);
-		free(task);
+		if(!task->embedded) {
+			free(task);
+		}
 	}
 }
 
@@ -373,8 +523,16 @@ void threadpool_release() {
 	if(TEST_VAILD_PTR(P)) {
 		CHECK(!ATOMIC_TEST(P->running));
 		SPIN_LOCK(P);
+		ARRAY_FOREACH(pt, P->threads, thread *) {
+			FREE(*pt);
+		}
 		ARRAY_DESTROY(P->threads);
 		bound_block_queue_destroy(&P->queue, free_task_node);
+		for(int i=0; i<P->ndeque; ++i) {
+			ws_deque_destroy(&P->deques[i], free_task_node);
+		}
+		FREE(P->deques);
+		FREE(P->cpus);
 		SPIN_UNLOCK(P);
 		SPIN_DESTROY(P);
 		FREE(P);
@@ -386,8 +544,8 @@ thread *threadpool_handle_to_thread(int handle) {
 	thread *t = NULL;
 	SPIN_LOCK(P);
 	if(handle > INVAILD_THREAD_HANDLE &&
-			handle < ARRAY_SIZE(P->threads, thread)) {
-		t = ARRAY_AT_PTR(P->threads, thread, handle);
+			handle < ARRAY_SIZE(P->threads, thread *)) {
+		t = ARRAY_AT_REF(P->threads, thread *, handle);
 	}
 	SPIN_UNLOCK(P);
 	return t;
@@ -428,20 +586,21 @@ int threadpool_boost_thread(thread_callback callback, void *arg, const char *tna
 	SPIN_LOCK(P);
 	if(check_can_create_worker()) {
 		/* 优先复用旧的空间 */
-		ARRAY_FOREACH(ptr, P->threads, thread) {
+		ARRAY_FOREACH(pt, P->threads, thread *) {
+			thread *ptr = *pt;
 			if(ptr) {
 				if(ptr->type == THREAD_WORKER && ptr->state == joined) {
 					t = ptr;
 					thread_release(t);
-					handle = ARRAY_INDEX(ptr, P->threads, thread);
+					handle = ARRAY_INDEX(pt, P->threads, thread *);
 				}
 			}
 		}
 		/* 开辟新的空间 */
 		if(!t) {
-			t = ARRAY_OFFSET(P->threads, thread, 1);
+			t = inner_thread_alloc(P);
 			if(t) {
-				handle = ARRAY_SIZE(P->threads, thread) - 1;
+				handle = ARRAY_SIZE(P->threads, thread *) - 1;
 			}
 		}
 		/* 初始化 */
@@ -476,6 +635,71 @@ int threadpool_apply_service(thread_callback callback, void *arg, const char *tn
 	return threadpool_boost_thread(callback, arg, tname, THREAD_SERVICE);
 }
 
+/* worker单次睡眠的最长时间(秒)，保证单独停止的worker能及时退出 */
+#define WORKER_PARK_TIMEOUT		0.1
+
+static inline uint32_t inner_steal_random() {
+	/* xorshift */
+	uint32_t x = t_stealSeed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	t_stealSeed = x;
+	return x;
+}
+
+/* 从随机位置开始依次尝试窃取其他worker的任务 */
+static queue_node *inner_steal_task(threadpool *pool) {
+	int n = MIN(atomic_get(&pool->nworker_deque), pool->ndeque);
+	if(n <= 0)
+		return NULL;
+
+	int start = inner_steal_random() % n;
+	for(int i=0; i<n; ++i) {
+		ws_deque *victim = ATOM_LOAD_ACQ(&pool->deques[(start + i) % n]);
+		if(TEST_VAILD_PTR(victim) && victim != t_deque) {
+			queue_node *node = ws_deque_steal(victim);
+			if(node) {
+				ATOM_INC_NEW(&pool->steals);
+				return node;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* *
+ * 本地队列 --> 全局队列 --> 窃取
+ * 本地队列也从top端按先进先出取，不停重新调度自己的servlet不会饿死同一队列中的其他任务
+ * */
+static queue_node *inner_next_task(threadpool *pool) {
+	queue_node *node = NULL;
+	if(TEST_VAILD_PTR(t_deque)) {
+		node = ws_deque_steal(t_deque);
+	}
+	if(!node) {
+		node = bound_block_queue_try_pop(pool->queue);
+	}
+	if(!node) {
+		node = inner_steal_task(pool);
+	}
+
+	return node;
+}
+
+static void inner_register_deque(threadpool *pool) {
+	int index = atomic_inc(&pool->nworker_deque) - 1;
+	if(index < pool->ndeque) {
+		ws_deque *deque = ws_deque_create(pool->limit.task);
+		if(TEST_VAILD_PTR(deque)) {
+			ATOM_STORE_REL(&pool->deques[index], deque);
+			t_deque = deque;
+		}
+	}
+	t_stealSeed = (uint32_t)thread_current_id() * 2654435761u | 1;
+}
+
 void worker_routine(void *input) {
 	threadpool *pool = (threadpool *)input;
 	thread *self = thread_self();
@@ -483,33 +707,148 @@ void worker_routine(void *input) {
 	assert(self != NULL);
 	queue_node *node = NULL;
 
+	if(pool->limit.pin_worker) {
+		/* 跳过loop独占的cpu，worker多于cpu时轮流共享 */
+		int reserved = pool->limit.pin_loop ? pool->limit.loop : 0;
+		int index = atomic_inc(&pool->bound_worker) - 1;
+		(void)inner_bind_cpu(self, pool->cpus[reserved + index % (pool->ncpu - reserved)]);
+	}
+	inner_register_deque(pool);
+
+	int round = 0;
 	while (self->state == started) {
-		node = bound_block_queue_pop(pool->queue);
+		node = inner_next_task(pool);
+		if(!node) {
+			/* 自旋 --> 让出cpu --> 睡眠，睡眠前登记后再检查一次，不会漏掉唤醒 */
+			if(idle_strategy_backoff(&pool->limit.idle, round ++))
+				continue;
+			int key = eventcount_prepare(&pool->idle);
+			node = inner_next_task(pool);
+			if(node) {
+				eventcount_cancel(&pool->idle);
+			} else {
+				eventcount_wait(&pool->idle, key, WORKER_PARK_TIMEOUT);
+			}
+			round = 0;
+		}
 		if(node) {
+			round = 0;
 			threadpool_task *task = DATA(node, threadpool_task, node);
+			/* 嵌入式task在routine中可能被重新提交，之后不能再访问 */
+			bool embedded = task->embedded;
 			if (TEST_VAILD_PTR(task->input)) {
-				task->result = task->routine(task->input, &task->errcode);
-				if (TEST_VAILD_PTR(task->done)) {
-					task->done(task->result, task->errcode);
+				task_done done = task->done;
+				int errcode = ERROR_SUCCESS;
+				void *result = task->routine(task->input, &errcode);
+				if(!embedded) {
+					task->result = result;
+					task->errcode = errcode;
 				}
+				if (TEST_VAILD_PTR(done)) {
+					done(result, errcode);
+				}
+			}
+
+			if(!embedded) {
+				FREE(task);
 			}
-			// 优化：使用task链
-			FREE(task);
 		}
 	}
+	/* 本地队列由threadpool_release释放，其中剩余的任务可以继续被窃取 */
+	NUL(t_deque);
 }
 
-int threadpool_submit(threadpool_task *task) {
-	CHECK_VAILD_PTR(P);
+static inline void inner_ensure_worker() {
 	if(P->worker < P->limit.worker) {
 		char buf[MAX_THREAD_NAME + 1];
 		snprintf(buf, sizeof buf, "worker%d", P->worker + 1);
 		(void)threadpool_boost_thread(worker_routine, P, buf, THREAD_WORKER);
 	}
-	if(bound_block_queue_push(P->queue, &task->node))
+}
+
+int threadpool_submit(threadpool_task *task) {
+	CHECK_VAILD_PTR(P);
+	inner_ensure_worker();
+	if(bound_block_queue_push(P->queue, &task->node)) {
+		(void)eventcount_notify(&P->idle, 1);
 		return ERROR_SUCCESS;
-	else
+	} else {
+		return ERROR_FAILD;
+	}
+}
+
+int threadpool_try_submit(threadpool_task *task) {
+	CHECK_VAILD_PTR(P);
+	/* worker提交的任务进入本地队列，空闲的worker可以窃取 */
+	if(TEST_VAILD_PTR(t_deque)) {
+		if(ws_deque_push(t_deque, &task->node)) {
+			(void)eventcount_notify(&P->idle, 1);
+			return ERROR_SUCCESS;
+		}
+	}
+
+	inner_ensure_worker();
+	if(bound_block_queue_try_push(P->queue, &task->node)) {
+		(void)eventcount_notify(&P->idle, 1);
+		return ERROR_SUCCESS;
+	} else {
 		return ERROR_FAILD;
+	}
+}
+
+int threadpool_bind_loop() {
+	CHECK_VAILD_PTR(P);
+	int cpu = -1;
+	if(P->limit.pin_loop) {
+		int index = atomic_inc(&P->bound_loop) - 1;
+		if(index < P->limit.loop && TEST_SUCCESS(inner_bind_cpu(thread_self(), P->cpus[index]))) {
+			cpu = P->cpus[index];
+		}
+	}
+
+	return cpu;
+}
+
+void threadpool_report() {
+	CHECK_VAILD_PTR(P);
+	SPIN_LOCK(P);
+	printf("threadpool: %d cpus, %d workers, %d services, %llu parks, %llu wakes, %llu steals\n",
+			P->ncpu, P->worker, P->service, (unsigned long long)ATOM_LOAD(&P->idle.parks),
+			(unsigned long long)ATOM_LOAD(&P->idle.wakes), (unsigned long long)ATOM_LOAD(&P->steals));
+	ARRAY_FOREACH(pt, P->threads, thread *) {
+		thread *t = *pt;
+		if(t && t->state != joined && t->state != nostart) {
+			if(t->cpu >= 0)
+				printf("  %-16s tid %-6d cpu %d\n", t->name, t->tid, t->cpu);
+			else
+				printf("  %-16s tid %-6d cpu any\n", t->name, t->tid);
+		}
+	}
+	SPIN_UNLOCK(P);
+}
+
+bool threadpool_has_pending() {
+	CHECK_VAILD_PTR(P);
+	/* 只是提示：不加锁读取各队列长度 */
+	if(bound_block_queue_size(P->queue) > 0)
+		return true;
+
+	int n = MIN(atomic_get(&P->nworker_deque), P->ndeque);
+	for(int i=0; i<n; ++i) {
+		ws_deque *deque = ATOM_LOAD_ACQ(&P->deques[i]);
+		if(TEST_VAILD_PTR(deque) && ws_deque_size(deque) > 0)
+			return true;
+	}
+
+	return false;
+}
+
+void threadpool_get_stat(threadpool_stat *stat) {
+	CHECK_VAILD_PTR(P);
+	CHECK_VAILD_PTR(stat);
+	stat->parks = ATOM_LOAD(&P->idle.parks);
+	stat->wakes = ATOM_LOAD(&P->idle.wakes);
+	stat->steals = ATOM_LOAD(&P->steals);
 }
 
 void threadpool_stop_thread(int handle) {
@@ -522,7 +861,8 @@ void threadpool_stop_thread(int handle) {
 void threadpool_stop() {
 	CHECK_VAILD_PTR(P);
 	SPIN_LOCK(P);
-	ARRAY_FOREACH(t, P->threads, thread) {
+	ARRAY_FOREACH(pt, P->threads, thread *) {
+		thread *t = *pt;
 		if(t) {
 			if(t->type==THREAD_SERVICE || t->type == THREAD_WORKER) {
 				thread_stop(t);
@@ -532,8 +872,10 @@ void threadpool_stop() {
 	}
 	SPIN_UNLOCK(P);
 	bound_block_queue_finish(P->queue);
+	(void)eventcount_notify_all(&P->idle);
 
-	ARRAY_FOREACH(t, P->threads, thread) {
+	ARRAY_FOREACH(pt, P->threads, thread *) {
+		thread *t = *pt;
 		if(t) {
 			if(t->type==THREAD_SERVICE || t->type == THREAD_WORKER) {
 				if(t->state == stopping || t->state == stoped) {
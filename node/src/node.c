@@ -17,23 +17,33 @@
 #include <module.h>
 #include <logger.h>
 
-const char *service_batch[][SERVICE_STAGE_MAX] = {
-	{ "log", "gate", NULL },
-	{ "console", NULL },
-	{ "http", "pinpon", NULL },
+/* 每行{ 服务名, 依赖..., NULL }：console和http在gate的loop上注册端口 */
+const char *service_graph[][SERVICE_STAGE_MAX] = {
+	{ "log", NULL },
+	{ "gate", NULL },
+	{ "console", "gate", NULL },
+	{ "http", "gate", NULL },
+	{ "pinpon", "http", NULL },
 	{ NULL }
 };
 
 int main() {
 	int errcode = ERROR_SUCCESS;
+	/* gate占用一个I/O loop线程，其余cpu留给worker */
+	threadpool_limit limit;
+	threadpool_limit_init(&limit);
+	threadpool_limit_loop(&limit, 1);
+	threadpool_limit_affinity(&limit, true, true);
+
 	errcode |= env_init("/Users/linzer/Documents/config");
 	errcode |= context_init();
 	errcode |= module_init();
 	errcode |= service_init();
-	errcode |= threadpool_init(NULL);
+	errcode |= threadpool_init(&limit);
 	errcode |= monitor_init();
 
-	errcode |= service_batch_boost(service_batch);
+	errcode |= service_graph_boost(service_graph);
+	threadpool_report();
 	/*
 	service_boost("gate");
 	if(TEST_SUCCESS(service_wait("gate", STAGE_AFTER, SERVICE_INITING, 5))) {